@@ -2,94 +2,258 @@
 
 #include <algorithm>
 #include <charconv>
-#include <execution>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
 #include <vector>
 
+#include "hash_utils.hpp"
 #include "likely_unlikely.hpp"
+#include "parallel.hpp"
 
 namespace choose {
 
-template <typename ExecutionPolicy, typename it, typename Comp>
-void stable_partial_sort(ExecutionPolicy&& policy, it begin, it middle, it end, Comp comp) {
-  // adapted from https://stackoverflow.com/a/27248519/15534181
-  std::vector<it> sorted;
-  sorted.resize(end - begin);
-  auto to = sorted.begin();
-  for (auto p = begin; p != end; ++p) {
-    *to++ = p;
+// places the first (middle - begin) elements of the sorted range at the
+// beginning, in order. equal elements keep their relative order. the rest of the
+// range is left in an unspecified (moved from) state.
+//
+// the work is done on indices; ties are broken by index so the selection can be
+// an unstable nth_element followed by a sort of only the selected part. each
+// selected element is moved twice, and nothing else is touched
+template <typename it, typename Comp>
+void stable_partial_sort(const parallel::Threads& threads, it begin, it middle, it end, Comp comp) {
+  size_t total = end - begin;
+  size_t n = middle - begin;
+  if (n == 0) {
+    return;
+  }
+  std::vector<size_t> indices(total);
+  for (size_t i = 0; i < total; ++i) {
+    indices[i] = i;
   }
 
-  auto n = middle - begin;
-  std::partial_sort(std::forward<ExecutionPolicy>(policy), sorted.begin(), sorted.begin() + n, sorted.end(), [&](const it& lhs, const it& rhs) {
-    // First see if the underlying elements differ.
-    if (comp(*lhs, *rhs)) {
+  auto index_comp = [&](size_t lhs, size_t rhs) -> bool {
+    if (comp(begin[lhs], begin[rhs])) {
       return true;
     }
-    if (comp(*rhs, *lhs)) {
+    if (comp(begin[rhs], begin[lhs])) {
       return false;
     }
-    // Underlying elements are the same, so compare iterators; these represent
-    // position in original vector.
     return lhs < rhs;
-  });
+  };
 
-  std::vector<typename it::value_type> replacement;
-  replacement.resize(n);
-  for (decltype(n) i = 0; i < n; ++i) {
-    replacement[i] = *sorted[i];
+  if (n < total) {
+    size_t chunks = threads.count;
+    if (chunks > 1 && total / chunks > 2 * n) {
+      // each thread selects the best n in its chunk. then the best n of those
+      std::vector<size_t> candidates(chunks * n);
+      parallel::run(threads, chunks, [&](size_t c) {
+        auto chunk_begin = indices.begin() + total * c / chunks;
+        auto chunk_end = indices.begin() + total * (c + 1) / chunks;
+        std::nth_element(chunk_begin, chunk_begin + n, chunk_end, index_comp);
+        std::copy(chunk_begin, chunk_begin + n, candidates.begin() + n * c);
+      });
+      std::nth_element(candidates.begin(), candidates.begin() + n, candidates.end(), index_comp);
+      std::copy(candidates.begin(), candidates.begin() + n, indices.begin());
+    } else {
+      std::nth_element(indices.begin(), indices.begin() + n, indices.end(), index_comp);
+    }
   }
+  parallel::sort(threads, indices.begin(), indices.begin() + n, index_comp);
 
-  auto from = replacement.cbegin();
-  for (auto pos = begin; pos != middle; ++end) {
-    *pos++ = *from++;
+  std::vector<typename std::iterator_traits<it>::value_type> selected;
+  selected.reserve(n);
+  for (size_t i = 0; i < n; ++i) {
+    selected.push_back(std::move(begin[indices[i]]));
   }
+  std::move(selected.begin(), selected.end(), begin);
 }
 
-bool general_numeric_compare(const char* lhs_begin, const char* lhs_end, const char* rhs_begin, const char* rhs_end) { //
-  float lhs = 0;
-  float rhs = 0;
-  // if from_chars isn't found, get a newer compiler. e.g.
-  //    add-apt-repository -y ppa:ubuntu-toolchain-r/test
-  //    apt-get install g++-11
-  //    cd build && cmake .. -DCMAKE_C_COMPILER=gcc-11 -DCMAKE_CXX_COMPILER=g++-11
-  std::from_chars_result lhs_ret = std::from_chars(lhs_begin, lhs_end, lhs, std::chars_format::general);
-  std::from_chars_result rhs_ret = std::from_chars(rhs_begin, rhs_end, rhs, std::chars_format::general);
+// a tournament tree for a k-way merge of k sources. each node keeps the loser
+// of the match played there, and the overall winner is kept separately. after
+// the winner's source moves on to its next element, only the matches on the
+// path from its leaf to the root are replayed: log2(k) comparisons, about half
+// as many as a binary heap.
+//
+// less(a, b) is true if source a's current element goes before source b's.
+// ties go to the lower source, so the merge is stable
+template <typename Less>
+struct LoserTree {
+ private:
+  size_t k;
+  Less less;
+  std::vector<size_t> nodes; // nodes[0] is the winner. the rest are losers
+  std::vector<bool> done;    // an exhausted source loses every match
+
+  bool beats(size_t a, size_t b) const {
+    if (this->done[a] || this->done[b]) {
+      return !this->done[a] && (this->done[b] || a < b);
+    }
+    if (this->less(a, b)) {
+      return true;
+    }
+    if (this->less(b, a)) {
+      return false;
+    }
+    return a < b;
+  }
 
-  // entire string conversion not required for parse success.
-  if (rhs_ret.ec != std::errc()) {
-    return false; // rhs parse failure. even if lhs also had parse failure, false returned here
+ public:
+  // exhausted[i] is true if source i has no elements to begin with
+  LoserTree(size_t k, Less less, std::vector<bool> exhausted) //
+      : k(k), less(less), nodes(k == 0 ? 1 : k), done(std::move(exhausted)) {
+    if (k == 0) {
+      this->done.push_back(true);
+      return;
+    }
+    // the leaves are k to 2k - 1, for sources 0 to k - 1
+    std::vector<size_t> winners(2 * k);
+    for (size_t i = 0; i < k; ++i) {
+      winners[k + i] = i;
+    }
+    for (size_t node = k - 1; node >= 1; --node) {
+      size_t a = winners[2 * node];
+      size_t b = winners[2 * node + 1];
+      bool a_wins = this->beats(a, b);
+      winners[node] = a_wins ? a : b;
+      this->nodes[node] = a_wins ? b : a;
+    }
+    this->nodes[0] = k == 1 ? 0 : winners[1];
   }
 
-  if (lhs_ret.ec != std::errc()) {
-    return true; // lhs parse failure and rhs parse success
+  // the source with the next element
+  size_t winner() const { return this->nodes[0]; }
+
+  // true once every source is exhausted
+  bool empty() const { return this->done[this->nodes[0]]; }
+
+  // call after the winner moves on to its next element, or is exhausted
+  void replay(bool winner_exhausted) {
+    size_t winner = this->nodes[0];
+    this->done[winner] = winner_exhausted;
+    for (size_t node = (winner + this->k) / 2; node >= 1; node /= 2) {
+      if (this->beats(this->nodes[node], winner)) {
+        std::swap(this->nodes[node], winner);
+      }
+    }
+    this->nodes[0] = winner;
   }
+};
 
-  return lhs < rhs;
-}
+namespace {
 
-bool general_numeric_equal(const char* lhs_begin, const char* lhs_end, const char* rhs_begin, const char* rhs_end) {
-  float lhs = 0;
-  float rhs = 0;
-  std::from_chars_result lhs_ret = std::from_chars(lhs_begin, lhs_end, lhs, std::chars_format::general);
-  std::from_chars_result rhs_ret = std::from_chars(rhs_begin, rhs_end, rhs, std::chars_format::general);
+// from_chars leaves the value untouched when it's out of range. this decides
+// if the number was too large (inf) or too small (0) from the text itself
+double general_numeric_out_of_range(const char* begin, const char* end) {
+  bool negative = false;
+  if (begin != end && (*begin == '-' || *begin == '+')) {
+    negative = *begin == '-';
+    ++begin;
+  }
+
+  // the position of the leading non zero digit, relative to the decimal point
+  long magnitude = 0;
+  bool found_non_zero = false;
+  bool past_point = false;
+  for (; begin != end; ++begin) {
+    char ch = *begin;
+    if (ch == '.') {
+      past_point = true;
+    } else if (ch >= '0' && ch <= '9') {
+      if (ch != '0') {
+        found_non_zero = true;
+      }
+      if (!past_point && found_non_zero) {
+        ++magnitude;
+      } else if (past_point && !found_non_zero) {
+        --magnitude;
+      }
+    } else {
+      break;
+    }
+  }
 
-  bool lhs_err = lhs_ret.ec != std::errc();
-  bool rhs_err = rhs_ret.ec != std::errc();
-  if (lhs_err || rhs_err) {
-    return lhs_err && rhs_err;
+  // the exponent is only looked at as far as its sign and if it's large
+  if (begin != end && (*begin == 'e' || *begin == 'E')) {
+    ++begin;
+    bool negative_exponent = false;
+    if (begin != end && (*begin == '-' || *begin == '+')) {
+      negative_exponent = *begin == '-';
+      ++begin;
+    }
+    long exponent = 0;
+    for (; begin != end && *begin >= '0' && *begin <= '9'; ++begin) {
+      if (exponent < 100000000) {
+        exponent = exponent * 10 + (*begin - '0');
+      }
+    }
+    magnitude += negative_exponent ? -exponent : exponent;
   }
 
-  return lhs == rhs;
+  double ret = magnitude > 0 ? std::numeric_limits<double>::infinity() : 0;
+  return negative ? -ret : ret;
 }
 
-size_t general_numeric_hash(const char* begin, const char* end) {
-  float val = 0;
-  std::from_chars_result ret = std::from_chars(begin, end, val, std::chars_format::general);
+} // namespace
+
+// parses a general numeric string. returns false on parse failure.
+// the entire string doesn't need to be consumed for parse success
+bool general_numeric_parse(const char* begin, const char* end, double& out) {
+  // if from_chars isn't found, get a newer compiler. e.g.
+  //    add-apt-repository -y ppa:ubuntu-toolchain-r/test
+  //    apt-get install g++-11
+  //    cd build && cmake .. -DCMAKE_C_COMPILER=gcc-11 -DCMAKE_CXX_COMPILER=g++-11
+  std::from_chars_result ret = std::from_chars(begin, end, out, std::chars_format::general);
+  if (likely(ret.ec == std::errc())) {
+    return true;
+  }
+  if (ret.ec == std::errc::result_out_of_range) {
+    out = general_numeric_out_of_range(begin, ret.ptr);
+    return true;
+  }
+  return false;
+}
 
-  if (ret.ec != std::errc()) {
-    return 0; // parse failure gives 0 hash
+// maps a general numeric string to an integer with the same ordering, so it
+// only needs to be parsed once and can then be compared or hashed directly.
+//  - parse failures are 0, and come first
+//  - nan is 1, after parse failures but before any number
+//  - -0 and 0 are the same
+// otherwise, it's the bits of the double, flipped such that unsigned integer
+// comparison agrees with the double comparison
+uint64_t general_numeric_key(const char* begin, const char* end) {
+  double val = 0;
+  if (!general_numeric_parse(begin, end, val)) {
+    return 0;
+  }
+  if (unlikely(val != val)) {
+    return 1;
+  }
+  if (val == 0) {
+    val = 0; // -0 -> 0
+  }
+  uint64_t bits; // NOLINT
+  static_assert(sizeof(bits) == sizeof(val));
+  std::memcpy(&bits, &val, sizeof(bits));
+  if (bits >> 63) {
+    return ~bits; // negative. larger magnitude is smaller
+  } else {
+    return bits | ((uint64_t)1 << 63);
   }
-  return (size_t)val; // identity
+}
+
+bool general_numeric_compare(const char* lhs_begin, const char* lhs_end, const char* rhs_begin, const char* rhs_end) { //
+  return general_numeric_key(lhs_begin, lhs_end) < general_numeric_key(rhs_begin, rhs_end);
+}
+
+bool general_numeric_equal(const char* lhs_begin, const char* lhs_end, const char* rhs_begin, const char* rhs_end) {
+  return general_numeric_key(lhs_begin, lhs_end) == general_numeric_key(rhs_begin, rhs_end);
+}
+
+// no collisions between non equal values (the mix is bijective)
+size_t general_numeric_hash(const char* begin, const char* end) { //
+  return hash::mix64(general_numeric_key(begin, end));
 };
 
 // locale is not used for numeric functions. keeping consistent with
@@ -588,18 +752,10 @@ int main() {
 
     bool hash_equal = lhs_hash == rhs_hash;
     if (equal != hash_equal) {
-      bool skip = false;
-      if constexpr (!use_numeric) {
-        // general_numeric has high collision from 0 hash for parse failures - skip
-        if (lhs_hash == 0 && rhs_hash == 0) {
-          skip = true;
-        }
-      }
-      if (!skip) {
-        printf("equal %d, hash equal %d\n", equal, hash_equal);
-        // will eventually happen due to hash collisions
-        on_failure("hash equality and equality disagree");
-      }
+      printf("equal %d, hash equal %d\n", equal, hash_equal);
+      // for numeric, will eventually happen due to hash collisions.
+      // general_numeric has no collisions
+      on_failure("hash equality and equality disagree");
     }
 
     auto middle = get_rand_vec();
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace choose {
+
+// stores the bytes of the tokens. bytes are appended into large chunks, and
+// never move once placed (so tokens can point into them). there is no
+// individual deallocation; the whole arena is released at once
+struct Arena {
+  static constexpr size_t INITIAL_CHUNK_SIZE = 1 << 12;
+  static constexpr size_t MAX_CHUNK_SIZE = 1 << 24;
+
+  std::vector<std::unique_ptr<char[]>> chunks;
+  char* pos = nullptr;
+  size_t remaining = 0;
+  size_t next_chunk_size = INITIAL_CHUNK_SIZE;
+  // sum of chunk sizes
+  size_t bytes_reserved = 0;
+  // bytes handed out from the arena
+  size_t bytes_used = 0;
+
+  Arena() = default;
+  Arena(const Arena&) = delete;
+  Arena(Arena&&) = default;
+  Arena& operator=(const Arena&) = delete;
+  Arena& operator=(Arena&&) = default;
+  ~Arena() = default;
+
+  char* allocate(size_t n) {
+    if (n > remaining) {
+      size_t chunk_size = next_chunk_size;
+      if (next_chunk_size < MAX_CHUNK_SIZE) {
+        next_chunk_size *= 2;
+      }
+      if (chunk_size < n) {
+        chunk_size = n; // oversized request gets a chunk to itself
+      }
+      chunks.emplace_back(new char[chunk_size]);
+      pos = chunks.back().get();
+      remaining = chunk_size;
+      bytes_reserved += chunk_size;
+    }
+    char* ret = pos;
+    pos += n;
+    remaining -= n;
+    bytes_used += n;
+    return ret;
+  }
+
+  // copy a range of bytes into the arena
+  const char* store(const char* begin, const char* end) {
+    size_t n = end - begin;
+    char* ret = allocate(n);
+    if (n != 0) {
+      std::memcpy(ret, begin, n);
+    }
+    return ret;
+  }
+
+  void clear() {
+    chunks.clear();
+    pos = nullptr;
+    remaining = 0;
+    next_chunk_size = INITIAL_CHUNK_SIZE;
+    bytes_reserved = 0;
+    bytes_used = 0;
+  }
+};
+
+} // namespace choose
@@ -1,17 +1,23 @@
 #pragma once
 #include <getopt.h>
 #include <unistd.h>
+#include <algorithm>
 #include <chrono>
+#include <cerrno>
 #include <csignal>
 #include <cstring>
 #include <limits>
+#include <memory>
 #include <optional>
+#include <string>
 #include <vector>
 // for version
 #include <ncursesw/curses.h>
 
 #include "numeric_utils.hpp"
 #include "ordered_op.hpp"
+#include "parallel.hpp"
+#include "unique_state.hpp"
 
 namespace choose {
 
@@ -19,7 +25,7 @@ namespace choose {
 #define choose_str(a) #a
 
 #define BUF_SIZE_DEFAULT 8192
-#define UNIQUE_LOAD_FACTOR_DEFAULT 0.125
+#define UNIQUE_LOAD_FACTOR_DEFAULT 0.875
 
 enum Comparison {
   lexicographical,
@@ -44,10 +50,33 @@ struct Arguments {
   bool unique = false; // indicates that any unique is applied
   Comparison unique_type = lexicographical;
   bool unique_use_set = false; // requires unique
-  // if unordered_map is used, this is the max load factor
-  // this default value seems to work well
+  // modifier on unique. only adjacent tokens are compared, like uniq
+  bool assume_sorted = false;
+  // modifiers on unique. only the most recently seen distinct tokens are
+  // remembered; past this many, or after this long, the least recently seen is
+  // forgotten. 0 indicates no limit
+  size_t unique_window = 0;
+  uint64_t unique_ttl_ms = 0;
+  // modifier on unique. only a fingerprint of each token is kept, not its bytes
+  bool unique_hashed = false;
+  // a path. the fingerprints are kept in this file, across runs. implies unique_hashed
+  const char* unique_state = nullptr;
+  // opened from unique_state while handling the args, so a bad file is reported like other arg errors
+  std::shared_ptr<UniqueState> unique_state_table;
+  // modifier on unique. each unique token is written with its number of occurrences
+  bool count = false;
+  // implies count. only this many of the most frequent tokens are written. 0 indicates unset
+  size_t top_frequent = 0;
+  // the number of tokens kept track of for top_frequent. more gives more accurate
+  // counts. 0 indicates unset (a multiple of top_frequent)
+  size_t top_frequent_capacity = 0;
+  // if the hash set is used, this is the max load factor
   float unique_load_factor = UNIQUE_LOAD_FACTOR_DEFAULT;
 
+  // for sorting. args will set it to a default value if it is unset. 0 indicates unset
+  unsigned threads = 0;
+  bool pin_threads = false;
+
   bool flip = false;
   bool flush = false;
   bool multiple_selections = false;
@@ -65,6 +94,16 @@ struct Arguments {
   std::optional<InLimitOp::T> out_end;
   bool truncate_no_bound = false;
 
+  // --merge. paths of already sorted inputs. "-" is the input
+  std::vector<const char*> merge_files;
+  // opened while handling the args, so a bad path is reported like other arg
+  // errors. NULL for "-". ownership goes to whatever merges them
+  std::vector<FILE*> merge_streams;
+
+  // number of bytes. a rough budget for the tokens stored while sorting. past
+  // this, sorted runs are written to temporary files. 0 indicates no limit
+  size_t max_memory = 0;
+
   // modifier on out_start and out_end. truncation is from the end not the beginning
   bool tail = false;
 
@@ -87,9 +126,7 @@ struct Arguments {
   const char* prompt = 0; // points inside one of the argv elements
   // primary is either the input delimiter if match = false, or the match target otherwise
   regex::code primary = 0;
-#ifndef CHOOSE_DISABLE_FIELD
   regex::code field = 0; // match special field on token, like what section to sort on
-#endif
 
   // shortcut for if the delimiter is a single byte; doesn't set/use primary.
   // doesn't have to go through pcre2 when finding the token separation
@@ -102,10 +139,15 @@ struct Arguments {
 
   // disable or allow warning
   bool can_drop_warn = true;
+  bool can_unsorted_warn = true;
 
   // a special case where the tokens can be sent directly to the output as they are received
   bool is_direct_output() const { //
-    return !tui && !sort && !flip && !tail;
+    return !tui && !sort && !flip && !tail && !count;
+  }
+
+  bool unique_is_windowed() const { //
+    return unique_window != 0 || unique_ttl_ms != 0;
   }
 
   // a subset of is_direct_output where the tokens don't need to be stored at all
@@ -113,11 +155,43 @@ struct Arguments {
     return is_direct_output() && !unique;
   }
 
-  // the elements in output vector are being inserted with any excess being discarded
+  // the elements in output vector are being inserted with any excess being discarded.
+  // with uniqueness, a token that was discarded is forgotten; a later duplicate
+  // of it must be discarded too, without remembering it:
+  //  - sorted: tokens equal under uniqueness must be equal under the sort. then a
+  //    later duplicate doesn't sort better than the discarded one, so it's
+  //    discarded again. this holds if the types match, or if uniqueness is
+  //    lexicographical (the same bytes are equal under any sort)
+  //  - unsorted: only the first tokens are kept, and nothing is discarded
+  //    before finishing. doesn't apply to --tail
   bool mem_is_bounded() const {
     return out_end.has_value()   //
            && !truncate_no_bound //
-           && (unique ? sort && unique_type == sort_type : true);
+           && !count             // counts are only known at the end
+           && (unique && !assume_sorted ? (sort ? unique_type == sort_type || unique_type == lexicographical : !tail) : true);
+  }
+
+  // sorting everything with a memory budget. the runs are merged and written
+  // directly to the output, so there can't be a tui or anything applied after.
+  // uniqueness is applied across the runs while merging
+  bool can_spill() const {
+    return max_memory != 0         //
+           && sort                 //
+           && !tui                 //
+           && !flip                //
+           && !count               //
+           && !mem_is_bounded()    //
+           && (!unique || assume_sorted || unique_is_merged());
+  }
+
+  // if uniqueness can be applied while merging sorted tokens, where only the
+  // group of tokens that sort equal to the current one is remembered (see
+  // SortedUniqueness). duplicates must sort equal. lexicographical uniqueness
+  // keeps the distinct tokens of the group. that isn't done for a general
+  // numeric sort, where every parse failure is in one group, so it could hold
+  // any number of tokens
+  bool unique_is_merged() const { //
+    return unique_type == sort_type || (unique_type == lexicographical && sort_type != general_numeric);
   }
 
   void drop_warning() {
@@ -132,6 +206,18 @@ struct Arguments {
       }
     }
   }
+
+  void unsorted_warning() {
+    if (this->can_unsorted_warn) {
+      this->can_unsorted_warn = false;
+      if (fileno(this->output) == STDOUT_FILENO) { // not unit test
+        fputs(
+            "Warning: the input isn't sorted, so --assume-sorted may leave duplicates. "
+            "Set --no-warn, or remove --assume-sorted.\n",
+            stderr);
+      }
+    }
+  }
 };
 
 namespace {
@@ -144,9 +230,7 @@ struct UncompiledCodes {
   std::vector<uncompiled::UncompiledOrderedOp> ordered_ops;
 
   std::vector<char> primary;
-#ifndef CHOOSE_DISABLE_FIELD
   const char* field = 0;
-#endif
 
   std::optional<InLimitOp::T> tail_start;
   std::optional<InLimitOp::T> tail_end;
@@ -194,11 +278,9 @@ struct UncompiledCodes {
       }
     }
 
-#ifndef CHOOSE_DISABLE_FIELD
     if (this->field) {
       output.field = regex::compile(this->field, re_options & ~PCRE2_LITERAL, "field");
     }
-#endif
   }
 };
 
@@ -287,6 +369,11 @@ void print_help_message() {
       "                same match options as the positional argument. has a higher\n"
       "                priority than --end. implies --tui\n"
       "options:\n"
+      "        --assume-sorted\n"
+      "                if --unique is specified, each token is only compared to the\n"
+      "                previous one, like uniq. nothing is stored for it, so this\n"
+      "                uses constant memory. the input should be sorted (ascending or\n"
+      "                descending) or grouped; a warning is given if it isn't\n"
       "        --auto-completion-strings\n"
       "        -b, --batch-delimiter <delimiter, default: <output-delimiter>>\n"
       "                a batch is a group of tokens. typically the output consists\n"
@@ -312,6 +399,10 @@ void print_help_message() {
       "                case where there is no ordered ops, no sorting, no uniqueness\n"
       "                no flip, and no tui used (it can be avoided since the token\n"
       "                parts are instead written directly to the output).\n"
+      "        --count\n"
+      "                implies -u. write each unique token prefixed by its number of\n"
+      "                occurrences, like uniq -c. the comparison is from the uniqueness\n"
+      "                options (--field, --unique-numeric, etc)\n"
       "        -d, --delimit-same\n"
       "                applies both --delimit-not-at-end and --use-delimiter. this\n"
       "                makes the output end with a delimiter when the input also ends\n"
@@ -330,9 +421,6 @@ void print_help_message() {
       "                match pattern for field used in sorting and uniqueness. inherits\n"
       "                the same match options as the positional argument, except it is\n"
       "                never literal\n"
-#ifdef CHOOSE_DISABLE_FIELD
-      "                WARNING --field is disabled\n"
-#endif
       "        --flip\n"
       "                reverse the token order. this is the last step before being sent\n"
       "                to the output or to the tui\n"
@@ -346,7 +434,8 @@ void print_help_message() {
       "                prints line \"yes\" iff memory usage is bounded from truncation\n"
       "                (--out/--tail), then exits. disable with --truncate-no-bound\n"
       "        --load-factor <positive float, default: " choose_xstr(UNIQUE_LOAD_FACTOR_DEFAULT) ">\n"
-      "                if a hash table is used for uniqueness, set the max load factor\n"
+      "                if a hash table is used for uniqueness, set the max load factor.\n"
+      "                values above 0.9375 are clamped\n"
       "        --locale <locale>\n"
       "        -m, --multi\n"
       "                allow the selection of multiple tokens\n"
@@ -359,6 +448,21 @@ void print_help_message() {
       "                the max number of characters that the pattern can look before\n"
       "                its beginning. if not specified, it is auto detected from the\n"
       "                pattern but may not be accurate for nested lookbehinds\n"
+      "        --merge <file>\n"
+      "                can be specified multiple times. each file (or - for stdin)\n"
+      "                is already sorted according to the sort options. the tokens\n"
+      "                from the files are merged into sorted output, without storing\n"
+      "                them all. stdin isn't read unless it is given. can't be used\n"
+      "                with the tui, --flip, --tail or --unique-use-set. if --unique is\n"
+      "                also used, it's like --max-memory\n"
+      "        --max-memory <# bytes>\n"
+      "                when sorting, roughly the most memory used to store the tokens.\n"
+      "                past this, the tokens are sorted and written to a temporary file\n"
+      "                in $TMPDIR (default /tmp). the files are merged at the end.\n"
+      "                can't be used with the tui or --flip. if --unique is also used,\n"
+      "                it must be the same type as the sort, or lexicographical for a\n"
+      "                lexicographical or numeric sort.\n"
+      "                requires sorting; unsorted uniqueness isn't limited by this\n"
       "        -n, --numeric\n"
       "                if --sort or --unique is specified it will be done numerically.\n"
       "                tokens should match: ^-?[0-9,]*(?:\\.[0-9]*)?$\n"
@@ -376,6 +480,9 @@ void print_help_message() {
       "        --out [<# tokens>|<start inclusive>,<stop exclusive>|<default: 10>]\n"
       "                truncate the output\n"
       "        -p, --prompt <tui prompt>\n"
+      "        --pin-threads\n"
+      "                pin each sorting thread to one of the cpus that choose is\n"
+      "                allowed to run on\n"
       "        -r, --regex\n"
       "                use PCRE2 regex for the positional argument.\n"
       "        --read <# bytes, default: <buf-size>>\n"
@@ -396,6 +503,15 @@ void print_help_message() {
       "        --selection-order\n"
       "                sort the token output based on tui selection order instead of\n"
       "                the input order. an indicator displays the order\n"
+      "        --top-frequent <# tokens>\n"
+      "                like --count, but only the most frequent tokens are written, most\n"
+      "                frequent first. uses a fixed amount of memory (space saving\n"
+      "                algorithm). if there are more distinct tokens than the capacity,\n"
+      "                the counts are upper bounds: each can be too high by at most the\n"
+      "                number of tokens in the input divided by the capacity\n"
+      "        --top-frequent-capacity <# tokens>\n"
+      "                the number of tokens kept track of by --top-frequent, at least\n"
+      "                the number written. default: 64 times that, and at least 1024\n"
       "        -t, --tui\n"
       "                display the tokens in a selection tui\n"
       "        --tail [<# tokens, default: 10>]\n"
@@ -403,13 +519,14 @@ void print_help_message() {
       "        --tenacious\n"
       "                on tui confirmed selection, do not exit; but still flush the\n"
       "                current selection to the output as a batch\n"
+      "        --threads <# threads, default: # of cpus available>\n"
+      "                the number of threads used for sorting and uniqueness\n"
       "        --truncate-no-bound\n"
       "                if truncation is specified (--out/--tail), choose may retain\n"
       "                only the relevant m tokens in memory, regardless of the number\n"
-      "                of tokens in the input, n. see --is-bounded. in these cases the\n"
-      "                time complexity is O(mn). if n is large, this gives quadratic\n"
-      "                scaling, in which case this option can be used to disable the\n"
-      "                bound, leading to more memory used but better speed\n"
+      "                of tokens in the input, n. see --is-bounded. when sorting, the\n"
+      "                time complexity is O(n log m), otherwise O(n). this option\n"
+      "                disables the bound, leading to more memory used\n"
       "        -u, --unique\n"
       "                remove duplicate input tokens. leaves first occurrences. applied\n"
       "                before sorting\n"
@@ -417,9 +534,26 @@ void print_help_message() {
       "                apply uniqueness numerically. implies -u\n"
       "        --unique-general-numeric\n"
       "                apply uniqueness general numerically. implies -u\n"
+      "        --unique-hashed\n"
+      "                implies -u. only remember a 128 bit fingerprint of each token\n"
+      "                instead of its bytes. distinct tokens are very unlikely to\n"
+      "                collide. requires that the output is written directly\n"
+      "        --unique-state <file>\n"
+      "                like --unique-hashed, but the fingerprints are kept in the file\n"
+      "                and loaded on the next run, so only tokens never seen by any\n"
+      "                run are written. the file is created if it doesn't exist\n"
       "        --unique-use-set\n"
-      "                implies -u. apply uniqueness with a tree instead of a hash table\n"
+      "                implies -u. apply uniqueness with a b-tree instead of a hash\n"
+      "                table. if sorting the same way, the sorted output is read from\n"
+      "                the tree\n"
       "                ignored if memory is bounded from truncation (see --is-bounded)\n"
+      "        --unique-ttl <duration>\n"
+      "                implies -u. a token is forgotten this long after it was last\n"
+      "                seen, so it can appear again. e.g. 500ms, 30s, 5m, 2h. for\n"
+      "                long running streams, when the output is written directly\n"
+      "        --unique-window <# tokens>\n"
+      "                implies -u. only this many of the most recently seen distinct\n"
+      "                tokens are remembered. like --unique-ttl\n"
       "        --use-delimiter\n"
       "                don't ignore a delimiter at the end of the input\n"
       "        --utf\n"
@@ -529,8 +663,16 @@ Arguments handle_args(int argc, char* const* argv, FILE* input = NULL, FILE* out
         {"buf-size-frag", required_argument, NULL, 0},
         {"rm", required_argument, NULL, 0},
         {"max-lookbehind", required_argument, NULL, 0},
+        {"max-memory", required_argument, NULL, 0},
+        {"merge", required_argument, NULL, 0},
         {"read", required_argument, NULL, 0},
         {"load-factor", required_argument, NULL, 0},
+        {"threads", required_argument, NULL, 0},
+        {"top-frequent", required_argument, NULL, 0},
+        {"top-frequent-capacity", required_argument, NULL, 0},
+        {"unique-state", required_argument, NULL, 0},
+        {"unique-ttl", required_argument, NULL, 0},
+        {"unique-window", required_argument, NULL, 0},
         {"locale", required_argument, NULL, 0},
         {"replace", required_argument, NULL, 0},
         {"head", optional_argument, NULL, 0},
@@ -538,6 +680,8 @@ Arguments handle_args(int argc, char* const* argv, FILE* input = NULL, FILE* out
         {"out", optional_argument, NULL, 0},
         {"tail", optional_argument, NULL, 0},
         // options
+        {"assume-sorted", no_argument, NULL, 0},
+        {"count", no_argument, NULL, 0},
         {"auto-completion-strings", no_argument, NULL, 0},
         {"delimit-same", no_argument, NULL, 'd'},
         {"delimit-not-at-end", no_argument, NULL, 0},
@@ -560,6 +704,7 @@ Arguments handle_args(int argc, char* const* argv, FILE* input = NULL, FILE* out
         {"unique-numeric", no_argument, NULL, 0},
         {"unique-general-numeric", no_argument, NULL, 0},
         {"no-warn", no_argument, NULL, 0},
+        {"pin-threads", no_argument, NULL, 0},
         {"regex", no_argument, NULL, 'r'},
         {"sed", no_argument, NULL, 0},
         {"sort", no_argument, NULL, 's'},
@@ -569,6 +714,7 @@ Arguments handle_args(int argc, char* const* argv, FILE* input = NULL, FILE* out
         {"truncate-no-bound", no_argument, NULL, 0},
         {"tui", no_argument, NULL, 't'},
         {"unique", no_argument, NULL, 'u'},
+        {"unique-hashed", no_argument, NULL, 0},
         {"unique-use-set", no_argument, NULL, 0},
         {"use-delimiter", no_argument, NULL, 0},
         {"utf", no_argument, NULL, 0},
@@ -673,16 +819,7 @@ Arguments handle_args(int argc, char* const* argv, FILE* input = NULL, FILE* out
           if (strcmp("rm", name) == 0 || strcmp("remove", name) == 0) {
             uncompiled_output.ordered_ops.push_back(uncompiled::UncompiledRmOrFilterOp{RmOrFilterOp::REMOVE, optarg});
           } else if (strcmp("field", name) == 0) {
-#ifdef CHOOSE_DISABLE_FIELD
-#ifdef CHOOSE_FUZZING_APPLIED
-            throw termination_request();
-#endif
-            arg_error_preamble(argc, argv);
-            fputs("--field is disabled\n", stderr);
-            arg_has_errors = true;
-#else
             uncompiled_output.field = optarg;
-#endif
           } else if (strcmp("buf-size", name) == 0) {
             ret.buf_size = num::parse_number<decltype(ret.buf_size)>(on_num_err, optarg, false);
             if (ret.buf_size > 2048) {
@@ -699,6 +836,20 @@ Arguments handle_args(int argc, char* const* argv, FILE* input = NULL, FILE* out
             head_handler(true);
           } else if (strcmp("max-lookbehind", name) == 0) {
             ret.max_lookbehind = num::parse_number<decltype(ret.max_lookbehind)>(on_num_err, optarg, true, false);
+          } else if (strcmp("merge", name) == 0) {
+            FILE* stream = NULL; // stdin
+            if (strcmp(optarg, "-") != 0) {
+              stream = fopen(optarg, "rb");
+              if (stream == NULL) {
+                arg_error_preamble(argc, argv);
+                fprintf(stderr, "failed to open --merge file %s: %s\n", optarg, strerror(errno));
+                arg_has_errors = true;
+              }
+            }
+            ret.merge_files.push_back(optarg);
+            ret.merge_streams.push_back(stream);
+          } else if (strcmp("max-memory", name) == 0) {
+            ret.max_memory = num::parse_number<decltype(ret.max_memory)>(on_num_err, optarg, false);
           } else if (strcmp("read", name) == 0) {
             ret.bytes_to_read = num::parse_number<decltype(ret.bytes_to_read)>(on_num_err, optarg, false, false);
           } else if (strcmp("out", name) == 0) {
@@ -737,6 +888,24 @@ Arguments handle_args(int argc, char* const* argv, FILE* input = NULL, FILE* out
             }
           } else if (strcmp("locale", name) == 0) {
             ret.locale = optarg;
+          } else if (strcmp("threads", name) == 0) {
+            ret.threads = num::parse_number<decltype(ret.threads)>(on_num_err, optarg, false);
+          } else if (strcmp("top-frequent", name) == 0) {
+            ret.unique = true;
+            ret.count = true;
+            ret.top_frequent = num::parse_number<decltype(ret.top_frequent)>(on_num_err, optarg, false);
+          } else if (strcmp("top-frequent-capacity", name) == 0) {
+            ret.top_frequent_capacity = num::parse_number<decltype(ret.top_frequent_capacity)>(on_num_err, optarg, false);
+          } else if (strcmp("unique-state", name) == 0) {
+            ret.unique = true;
+            ret.unique_hashed = true;
+            ret.unique_state = optarg;
+          } else if (strcmp("unique-ttl", name) == 0) {
+            ret.unique = true;
+            ret.unique_ttl_ms = num::parse_duration_ms(on_num_err, optarg);
+          } else if (strcmp("unique-window", name) == 0) {
+            ret.unique = true;
+            ret.unique_window = num::parse_number<decltype(ret.unique_window)>(on_num_err, optarg, false);
           } else if (strcmp("tail", name) == 0) {
             tail_handler(true);
           } else {
@@ -770,6 +939,9 @@ Arguments handle_args(int argc, char* const* argv, FILE* input = NULL, FILE* out
             uncompiled_output.primary_set = true;
           } else if (strcmp("no-warn", name) == 0) {
             ret.can_drop_warn = false;
+            ret.can_unsorted_warn = false;
+          } else if (strcmp("pin-threads", name) == 0) {
+            ret.pin_threads = true;
           } else if (strcmp("sort-numeric", name) == 0) {
             ret.sort = true;
             ret.sort_type = numeric;
@@ -801,6 +973,14 @@ Arguments handle_args(int argc, char* const* argv, FILE* input = NULL, FILE* out
             ret.truncate_no_bound = true;
           } else if (strcmp("index", name) == 0) {
             index_handler(false);
+          } else if (strcmp("count", name) == 0) {
+            ret.unique = true;
+            ret.count = true;
+          } else if (strcmp("assume-sorted", name) == 0) {
+            ret.assume_sorted = true;
+          } else if (strcmp("unique-hashed", name) == 0) {
+            ret.unique = true;
+            ret.unique_hashed = true;
           } else if (strcmp("unique-use-set", name) == 0) {
             ret.unique = true;
             ret.unique_use_set = true;
@@ -970,6 +1150,20 @@ Arguments handle_args(int argc, char* const* argv, FILE* input = NULL, FILE* out
   if (ret.bytes_to_read == std::numeric_limits<decltype(ret.bytes_to_read)>::max()) {
     ret.bytes_to_read = ret.buf_size;
   }
+  if (ret.threads == 0) {
+#ifdef CHOOSE_FUZZING_APPLIED
+    ret.threads = 1;
+#else
+    ret.threads = parallel::default_thread_count();
+#endif
+  }
+  if (ret.top_frequent != 0) {
+    if (ret.top_frequent_capacity == 0) {
+      auto mul_result = num::mul_overflow(ret.top_frequent, (decltype(ret.top_frequent))64);
+      ret.top_frequent_capacity = std::max<size_t>(mul_result ? *mul_result : ret.top_frequent, 1024);
+    }
+    ret.top_frequent_capacity = std::max(ret.top_frequent_capacity, ret.top_frequent);
+  }
   if (ret.buf_size_frag == std::numeric_limits<decltype(ret.bytes_to_read)>::max()) {
     // more than the match buffer size by default, since storing is less intensive
     if (auto mul_result = num::mul_overflow(ret.buf_size, (decltype(ret.buf_size))8)) {
@@ -1011,6 +1205,48 @@ Arguments handle_args(int argc, char* const* argv, FILE* input = NULL, FILE* out
       fputs("--sed is incompatible with options that prevents direct output, including: sorting, reverse, and tui.\n", stderr);
       exit(EXIT_FAILURE);
     }
+
+    if (!ret.merge_files.empty() && (ret.tui || ret.flip || ret.tail || ret.sed || ret.unique_use_set)) {
+      arg_error_preamble(argc, argv);
+      fputs("--merge is incompatible with the tui, --flip, --tail, --sed and --unique-use-set.\n", stderr);
+      exit(EXIT_FAILURE);
+    }
+
+    if (!ret.merge_files.empty() && ret.unique && !ret.unique_is_merged()) {
+      arg_error_preamble(argc, argv);
+      fputs("with --merge, uniqueness must be the same type as the sort, or lexicographical for a lexicographical or numeric sort.\n", stderr);
+      exit(EXIT_FAILURE);
+    }
+
+    if (ret.unique_is_windowed() && (!ret.is_direct_output() || ret.assume_sorted || !ret.merge_files.empty())) {
+      arg_error_preamble(argc, argv);
+      fputs("--unique-window and --unique-ttl require the output to be written directly. they are incompatible with the tui, sorting, --flip, --tail, --assume-sorted and --merge.\n", stderr);
+      exit(EXIT_FAILURE);
+    }
+
+    if (ret.unique_hashed && (!ret.is_direct_output() || ret.assume_sorted || !ret.merge_files.empty() || ret.unique_is_windowed() || ret.unique_use_set || ret.unique_type == numeric)) {
+      arg_error_preamble(argc, argv);
+      fputs("--unique-hashed and --unique-state require the output to be written directly. they are incompatible with the tui, sorting, --flip, --tail, --assume-sorted, --merge, --unique-window, --unique-ttl, --unique-use-set and --unique-numeric.\n", stderr);
+      exit(EXIT_FAILURE);
+    }
+
+    if (ret.count && (ret.tui || ret.assume_sorted || !ret.merge_files.empty())) {
+      arg_error_preamble(argc, argv);
+      fputs("--count and --top-frequent are incompatible with the tui, --assume-sorted and --merge.\n", stderr);
+      exit(EXIT_FAILURE);
+    }
+
+    if (ret.max_memory != 0 && !ret.sort) {
+      arg_error_preamble(argc, argv);
+      fputs("--max-memory only applies when sorting. it doesn't limit the memory used for uniqueness.\n", stderr);
+      exit(EXIT_FAILURE);
+    }
+
+    if (ret.max_memory != 0 && ret.sort && !ret.mem_is_bounded() && !ret.can_spill()) {
+      arg_error_preamble(argc, argv);
+      fputs("--max-memory is incompatible with the tui, --count and --flip (including --tail while sorting). uniqueness must be the same type as the sort, or lexicographical for a lexicographical or numeric sort.\n", stderr);
+      exit(EXIT_FAILURE);
+    }
   }
 
   if (uncompiled_output.is_bounded_query) {
@@ -1018,13 +1254,14 @@ Arguments handle_args(int argc, char* const* argv, FILE* input = NULL, FILE* out
     throw termination_request();
 #endif
     int exit_code = EXIT_SUCCESS;
-    if (ret.mem_is_bounded()) {
+    if (ret.mem_is_bounded() || ret.top_frequent) {
       exit_code = puts("yes") < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
     }
     exit(exit_code);
   }
 
-  if (isatty(fileno(ret.input))) {
+  bool reads_input = ret.merge_files.empty() || std::any_of(ret.merge_files.begin(), ret.merge_files.end(), [](const char* path) { return strcmp(path, "-") == 0; });
+  if (reads_input && isatty(fileno(ret.input))) {
 #ifdef CHOOSE_FUZZING_APPLIED
     throw termination_request();
 #endif
@@ -1032,6 +1269,28 @@ Arguments handle_args(int argc, char* const* argv, FILE* input = NULL, FILE* out
     exit(exit_code);
   }
 
+  if (ret.unique_state) {
+    // what decides the part of each token that's compared. it must be the same each time the file is used
+    std::string selection;
+    if (uncompiled_output.field) {
+      selection.append(uncompiled_output.field, strlen(uncompiled_output.field) + 1);
+      selection.append((const char*)&uncompiled_output.re_options, sizeof(uncompiled_output.re_options));
+    }
+    for (const uncompiled::UncompiledOrderedOp& op : uncompiled_output.ordered_ops) {
+      if (const uncompiled::UncompiledIndexOp* index_op = std::get_if<uncompiled::UncompiledIndexOp>(&op)) {
+        selection.push_back(index_op->align == IndexOp::BEFORE ? '\x01' : '\x02');
+      }
+    }
+    try {
+      uint64_t selection_hash = hash::bytes(selection.data(), selection.size(), 0);
+      ret.unique_state_table = std::make_shared<UniqueState>(ret.unique_state, (uint32_t)ret.unique_type, selection_hash);
+    } catch (const std::runtime_error& e) {
+      arg_error_preamble(argc, argv);
+      fprintf(stderr, "%s\n", e.what());
+      exit(EXIT_FAILURE);
+    }
+  }
+
   return ret;
 }
 
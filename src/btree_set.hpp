@@ -0,0 +1,352 @@
+#pragma once
+
+#include <cstdint>
+#include <utility>
+
+namespace choose {
+
+// an ordered set, as a b-tree. each node holds many elements next to each
+// other, so a lookup touches a few cache lines per level instead of a separate
+// allocation per element (like the red black tree in std::set). there are far
+// fewer allocations too.
+//
+// like FlatHashSet, the caller gives the comparison, and a lookup can be done on
+// something that isn't a real element yet (e.g. a candidate token). the found
+// position is then given to insert_at.
+template <typename T, typename Less>
+struct BTreeSet {
+  static constexpr uint16_t MAX_KEYS = 31;
+  static constexpr uint16_t MIN_KEYS = MAX_KEYS / 2; // for each node other than the root
+
+ private:
+  struct Node {
+    Node* parent = nullptr;
+    uint16_t position = 0; // index in the parent's children
+    uint16_t count = 0;
+    bool leaf = true;
+    T keys[MAX_KEYS];
+  };
+
+  struct Internal : Node {
+    Node* children[MAX_KEYS + 1];
+  };
+
+  static Node** children(Node* n) { return static_cast<Internal*>(n)->children; }
+
+  Less less;
+  Node* root = nullptr;
+  size_t size_ = 0;
+
+  static void destroy(Node* n) {
+    if (n->leaf) {
+      delete n;
+    } else {
+      for (uint16_t i = 0; i <= n->count; ++i) {
+        destroy(children(n)[i]);
+      }
+      delete static_cast<Internal*>(n);
+    }
+  }
+
+  // the first key which isn't less than key
+  uint16_t lower_index(const Node* n, const T& key) const {
+    uint16_t lo = 0;
+    uint16_t hi = n->count;
+    while (lo < hi) {
+      uint16_t mid = (lo + hi) / 2;
+      if (this->less(n->keys[mid], key)) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  // points n's children from begin onwards back to n
+  static void adopt(Node* n, uint16_t begin) {
+    for (uint16_t i = begin; i <= n->count; ++i) {
+      children(n)[i]->parent = n;
+      children(n)[i]->position = i;
+    }
+  }
+
+  // inserts key at index i of n. if n is internal, right is the child after key
+  void insert_into(Node* n, uint16_t i, const T& key, Node* right) {
+    if (n->count < MAX_KEYS) {
+      for (uint16_t j = n->count; j > i; --j) {
+        n->keys[j] = std::move(n->keys[j - 1]);
+      }
+      n->keys[i] = key;
+      if (!n->leaf) {
+        for (uint16_t j = n->count + 1; j > i + 1; --j) {
+          children(n)[j] = children(n)[j - 1];
+        }
+        children(n)[i + 1] = right;
+      }
+      ++n->count;
+      if (!n->leaf) {
+        adopt(n, i + 1);
+      }
+      return;
+    }
+
+    // full. split in half around the median, which moves up to the parent
+    T keys[MAX_KEYS + 1];
+    Node* kids[MAX_KEYS + 2];
+    for (uint16_t j = 0, k = 0; j <= MAX_KEYS; ++j) {
+      keys[j] = j == i ? key : std::move(n->keys[k++]);
+    }
+    if (!n->leaf) {
+      for (uint16_t j = 0, k = 0; j <= MAX_KEYS + 1; ++j) {
+        kids[j] = j == i + 1 ? right : children(n)[k++];
+      }
+    }
+
+    constexpr uint16_t MID = (MAX_KEYS + 1) / 2;
+    Node* sibling = n->leaf ? new Node() : new Internal();
+    sibling->leaf = n->leaf;
+    n->count = MID;
+    sibling->count = MAX_KEYS - MID;
+    for (uint16_t j = 0; j < MID; ++j) {
+      n->keys[j] = std::move(keys[j]);
+    }
+    for (uint16_t j = 0; j < sibling->count; ++j) {
+      sibling->keys[j] = std::move(keys[MID + 1 + j]);
+    }
+    if (!n->leaf) {
+      for (uint16_t j = 0; j <= MID; ++j) {
+        children(n)[j] = kids[j];
+      }
+      for (uint16_t j = 0; j <= sibling->count; ++j) {
+        children(sibling)[j] = kids[MID + 1 + j];
+      }
+      adopt(n, 0);
+      adopt(sibling, 0);
+    }
+
+    if (n == this->root) {
+      Internal* new_root = new Internal();
+      new_root->leaf = false;
+      new_root->count = 1;
+      new_root->keys[0] = std::move(keys[MID]);
+      new_root->children[0] = n;
+      new_root->children[1] = sibling;
+      this->root = new_root;
+      adopt(new_root, 0);
+    } else {
+      this->insert_into(n->parent, n->position, keys[MID], sibling);
+    }
+  }
+
+  // merges the children of p on each side of key k, along with the key
+  void merge_children(Node* p, uint16_t k) {
+    Node* left = children(p)[k];
+    Node* right = children(p)[k + 1];
+    left->keys[left->count] = std::move(p->keys[k]);
+    for (uint16_t j = 0; j < right->count; ++j) {
+      left->keys[left->count + 1 + j] = std::move(right->keys[j]);
+    }
+    if (!left->leaf) {
+      for (uint16_t j = 0; j <= right->count; ++j) {
+        children(left)[left->count + 1 + j] = children(right)[j];
+      }
+    }
+    uint16_t old_count = left->count;
+    left->count += 1 + right->count;
+    if (!left->leaf) {
+      adopt(left, old_count + 1);
+      delete static_cast<Internal*>(right);
+    } else {
+      delete right;
+    }
+
+    for (uint16_t j = k; j + 1 < p->count; ++j) {
+      p->keys[j] = std::move(p->keys[j + 1]);
+    }
+    for (uint16_t j = k + 1; j < p->count; ++j) {
+      children(p)[j] = children(p)[j + 1];
+    }
+    --p->count;
+    adopt(p, k + 1);
+  }
+
+  // n has had a key removed. restore the minimum number of keys
+  void rebalance(Node* n) {
+    while (n != this->root) {
+      if (n->count >= MIN_KEYS) {
+        return;
+      }
+      Node* p = n->parent;
+      uint16_t pos = n->position;
+      Node* left = pos > 0 ? children(p)[pos - 1] : nullptr;
+      Node* right = pos < p->count ? children(p)[pos + 1] : nullptr;
+      if (left && left->count > MIN_KEYS) {
+        // take the last key from the left sibling, through the parent
+        for (uint16_t j = n->count; j > 0; --j) {
+          n->keys[j] = std::move(n->keys[j - 1]);
+        }
+        n->keys[0] = std::move(p->keys[pos - 1]);
+        p->keys[pos - 1] = std::move(left->keys[left->count - 1]);
+        if (!n->leaf) {
+          for (uint16_t j = n->count + 1; j > 0; --j) {
+            children(n)[j] = children(n)[j - 1];
+          }
+          children(n)[0] = children(left)[left->count];
+        }
+        --left->count;
+        ++n->count;
+        if (!n->leaf) {
+          adopt(n, 0);
+        }
+        return;
+      }
+      if (right && right->count > MIN_KEYS) {
+        // take the first key from the right sibling, through the parent
+        n->keys[n->count] = std::move(p->keys[pos]);
+        p->keys[pos] = std::move(right->keys[0]);
+        for (uint16_t j = 0; j + 1 < right->count; ++j) {
+          right->keys[j] = std::move(right->keys[j + 1]);
+        }
+        if (!n->leaf) {
+          children(n)[n->count + 1] = children(right)[0];
+          for (uint16_t j = 0; j < right->count; ++j) {
+            children(right)[j] = children(right)[j + 1];
+          }
+        }
+        --right->count;
+        ++n->count;
+        if (!n->leaf) {
+          adopt(n, n->count);
+          adopt(right, 0);
+        }
+        return;
+      }
+      this->merge_children(p, left ? pos - 1 : pos);
+      n = p;
+    }
+
+    if (this->root->count == 0) {
+      Node* old_root = this->root;
+      if (old_root->leaf) {
+        this->root = nullptr;
+        delete old_root;
+      } else {
+        this->root = children(old_root)[0];
+        this->root->parent = nullptr;
+        this->root->position = 0;
+        delete static_cast<Internal*>(old_root);
+      }
+    }
+  }
+
+  template <typename F>
+  static void for_each(Node* n, F& f) {
+    for (uint16_t i = 0; i < n->count; ++i) {
+      if (!n->leaf) {
+        for_each(children(n)[i], f);
+      }
+      f(n->keys[i]);
+    }
+    if (!n->leaf) {
+      for_each(children(n)[n->count], f);
+    }
+  }
+
+ public:
+  // where an element is, or would be inserted
+  struct Position {
+    Node* node = nullptr;
+    uint16_t index = 0;
+  };
+
+  explicit BTreeSet(Less less) : less(less) {}
+  BTreeSet(const BTreeSet&) = delete;
+  BTreeSet& operator=(const BTreeSet&) = delete;
+  BTreeSet(BTreeSet&& o) : less(o.less), root(o.root), size_(o.size_) {
+    o.root = nullptr;
+    o.size_ = 0;
+  }
+  ~BTreeSet() { this->clear(); }
+
+  size_t size() const { return this->size_; }
+
+  // the second is true if an element equal to key was found. if it wasn't
+  // found, then the position should be given to insert_at, before any other
+  // modification of the set
+  std::pair<Position, bool> find_or_prepare_insert(const T& key) const {
+    Node* n = this->root;
+    if (n == nullptr) {
+      return {Position{}, false};
+    }
+    while (true) {
+      uint16_t i = this->lower_index(n, key);
+      if (i < n->count && !this->less(key, n->keys[i])) {
+        return {Position{n, i}, true};
+      }
+      if (n->leaf) {
+        return {Position{n, i}, false};
+      }
+      n = children(n)[i];
+    }
+  }
+
+  // the element at a position which was found
+  const T& at(Position pos) const { return pos.node->keys[pos.index]; }
+
+  void insert_at(Position pos, const T& value) {
+    ++this->size_;
+    if (this->root == nullptr) {
+      this->root = new Node();
+      this->root->keys[0] = value;
+      this->root->count = 1;
+      return;
+    }
+    this->insert_into(pos.node, pos.index, value, nullptr);
+  }
+
+  // returns true if an element equal to key was removed
+  bool erase(const T& key) {
+    auto [pos, found] = this->find_or_prepare_insert(key);
+    if (!found) {
+      return false;
+    }
+    Node* n = pos.node;
+    uint16_t i = pos.index;
+    if (!n->leaf) {
+      // replace with the previous element, which is in a leaf
+      Node* prev = children(n)[i];
+      while (!prev->leaf) {
+        prev = children(prev)[prev->count];
+      }
+      n->keys[i] = std::move(prev->keys[prev->count - 1]);
+      n = prev;
+      i = prev->count - 1;
+    }
+    for (uint16_t j = i; j + 1 < n->count; ++j) {
+      n->keys[j] = std::move(n->keys[j + 1]);
+    }
+    --n->count;
+    --this->size_;
+    this->rebalance(n);
+    return true;
+  }
+
+  void clear() {
+    if (this->root) {
+      destroy(this->root);
+      this->root = nullptr;
+    }
+    this->size_ = 0;
+  }
+
+  // calls f(const T&) on each element, in order
+  template <typename F>
+  void for_each(F f) const {
+    if (this->root) {
+      for_each(this->root, f);
+    }
+  }
+};
+
+} // namespace choose
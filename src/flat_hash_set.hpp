@@ -0,0 +1,281 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <utility>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "likely_unlikely.hpp"
+
+namespace choose {
+
+// an open addressing hash set, in the style of SwissTable (abseil's flat_hash_set).
+//
+// a control byte is kept for each slot, which is either empty, deleted, or the
+// low 7 bits of the element's hash. probing loads a group of 16 control bytes
+// at once and compares them all in parallel. elements with the same 7 bits are
+// only then checked, by first comparing the full hash stored next to the value.
+//
+// the table knows nothing about what is being stored. the caller gives the hash
+// and the equality check, so a lookup can be done on something that isn't yet
+// a T (e.g. a candidate token which isn't stored in the output yet).
+template <typename T>
+struct FlatHashSet {
+  struct Slot {
+    uint64_t hash;
+    T value;
+  };
+
+  static constexpr size_t GROUP_WIDTH = 16;
+  static constexpr size_t MIN_CAPACITY = GROUP_WIDTH;
+  static constexpr int8_t EMPTY = -128;
+  static constexpr int8_t DELETED = -2;
+
+ private:
+  // capacity + GROUP_WIDTH control bytes. the last GROUP_WIDTH are a copy of
+  // the first, so a group can be loaded at any position without wrapping
+  std::unique_ptr<int8_t[]> ctrl;
+  std::unique_ptr<Slot[]> slots;
+  size_t capacity_ = 0; // 0 or a power of 2
+  size_t size_ = 0;
+  // the number of elements that can be inserted before a rehash. deleted slots count against this
+  size_t growth_left = 0;
+  float max_load_factor_ = 0.875f;
+
+  static int8_t h2(uint64_t hash) { return (int8_t)(hash & 0x7F); }
+  static size_t h1(uint64_t hash) { return (size_t)(hash >> 7); }
+
+  struct Group {
+#ifdef __SSE2__
+    __m128i ctrl;
+    explicit Group(const int8_t* pos) : ctrl(_mm_loadu_si128((const __m128i*)pos)) {}
+
+    uint32_t match(int8_t h) const { //
+      return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h), ctrl));
+    }
+
+    // empty and deleted are the only control bytes with the high bit set
+    uint32_t match_empty_or_deleted() const { //
+      return (uint32_t)_mm_movemask_epi8(ctrl);
+    }
+#else
+    const int8_t* ctrl;
+    explicit Group(const int8_t* pos) : ctrl(pos) {}
+
+    uint32_t match(int8_t h) const {
+      uint32_t ret = 0;
+      for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+        ret |= (uint32_t)(ctrl[i] == h) << i;
+      }
+      return ret;
+    }
+
+    uint32_t match_empty_or_deleted() const {
+      uint32_t ret = 0;
+      for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+        ret |= (uint32_t)(ctrl[i] < 0) << i;
+      }
+      return ret;
+    }
+#endif
+    uint32_t match_empty() const { return match(EMPTY); }
+  };
+
+  static int lowest_bit(uint32_t mask) { return __builtin_ctz(mask); }
+
+  void set_ctrl(size_t i, int8_t h) {
+    ctrl[i] = h;
+    if (i < GROUP_WIDTH) {
+      ctrl[capacity_ + i] = h;
+    }
+  }
+
+  size_t max_elements(size_t capacity) const {
+    size_t ret = (size_t)((double)capacity * max_load_factor_);
+    if (ret == 0) {
+      return 1;
+    }
+    // at least one slot must remain empty so probing terminates
+    return ret >= capacity ? capacity - 1 : ret;
+  }
+
+  // the first empty or deleted slot on the probe sequence
+  size_t find_first_non_full(uint64_t hash) const {
+    size_t mask = capacity_ - 1;
+    size_t offset = h1(hash) & mask;
+    size_t step = 0;
+    while (true) {
+      uint32_t m = Group(&ctrl[offset]).match_empty_or_deleted();
+      if (m) {
+        return (offset + lowest_bit(m)) & mask;
+      }
+      step += GROUP_WIDTH;
+      offset = (offset + step) & mask;
+    }
+  }
+
+  void resize(size_t new_capacity) {
+    std::unique_ptr<int8_t[]> old_ctrl = std::move(ctrl);
+    std::unique_ptr<Slot[]> old_slots = std::move(slots);
+    size_t old_capacity = capacity_;
+
+    capacity_ = new_capacity;
+    ctrl.reset(new int8_t[capacity_ + GROUP_WIDTH]);
+    std::memset(ctrl.get(), EMPTY, capacity_ + GROUP_WIDTH);
+    slots.reset(new Slot[capacity_]);
+    growth_left = max_elements(capacity_) - size_;
+
+    // the hashes are stored, so nothing is recomputed and no elements are compared
+    for (size_t i = 0; i < old_capacity; ++i) {
+      if (old_ctrl[i] >= 0) {
+        uint64_t hash = old_slots[i].hash;
+        size_t pos = find_first_non_full(hash);
+        set_ctrl(pos, h2(hash));
+        slots[pos] = std::move(old_slots[i]);
+      }
+    }
+  }
+
+  void rehash_and_grow() {
+    if (capacity_ == 0) {
+      resize(MIN_CAPACITY);
+    } else if (size_ <= max_elements(capacity_) / 2) {
+      // mostly deleted slots. clean up without growing
+      resize(capacity_);
+    } else {
+      resize(capacity_ * 2);
+    }
+  }
+
+ public:
+  FlatHashSet() = default;
+  FlatHashSet(const FlatHashSet&) = delete;
+  FlatHashSet(FlatHashSet&&) = default;
+  FlatHashSet& operator=(const FlatHashSet&) = delete;
+  FlatHashSet& operator=(FlatHashSet&&) = default;
+  ~FlatHashSet() = default;
+
+  size_t size() const { return size_; }
+  size_t capacity() const { return capacity_; }
+
+  // clamped so that some slots always remain empty
+  void max_load_factor(float f) {
+    if (!(f > 0)) {
+      f = 0.875f;
+    } else if (f > 0.9375f) {
+      f = 0.9375f;
+    }
+    max_load_factor_ = f;
+    if (capacity_) {
+      size_t capacity = capacity_;
+      while (max_elements(capacity) <= size_) {
+        capacity *= 2;
+      }
+      resize(capacity);
+    }
+  }
+
+  // make room for n elements in total without a rehash
+  void reserve(size_t n) {
+    size_t capacity = MIN_CAPACITY;
+    while (max_elements(capacity) < n) {
+      capacity *= 2;
+    }
+    if (capacity > capacity_) {
+      resize(capacity);
+    }
+  }
+
+  // returns the slot index of an element with the hash, for which eq(value) is true.
+  // returns capacity() if it doesn't exist
+  template <typename Eq>
+  size_t find(uint64_t hash, Eq eq) const {
+    if (capacity_ == 0) {
+      return 0;
+    }
+    size_t mask = capacity_ - 1;
+    size_t offset = h1(hash) & mask;
+    size_t step = 0;
+    while (true) {
+      Group g(&ctrl[offset]);
+      uint32_t m = g.match(h2(hash));
+      while (m) {
+        size_t i = (offset + lowest_bit(m)) & mask;
+        if (likely(slots[i].hash == hash) && eq(slots[i].value)) {
+          return i;
+        }
+        m &= m - 1;
+      }
+      if (likely(g.match_empty())) {
+        return capacity_;
+      }
+      step += GROUP_WIDTH;
+      offset = (offset + step) & mask;
+    }
+  }
+
+  // the first is the slot index. the second is true if the element was found.
+  // if it wasn't found, then the slot index should be given to insert_at, before
+  // any other modification of the table
+  template <typename Eq>
+  std::pair<size_t, bool> find_or_prepare_insert(uint64_t hash, Eq eq) {
+    size_t i = find(hash, eq);
+    if (i != capacity_) {
+      return {i, true};
+    }
+    if (capacity_ == 0) {
+      rehash_and_grow();
+    }
+    i = find_first_non_full(hash);
+    if (unlikely(growth_left == 0 && ctrl[i] == EMPTY)) {
+      rehash_and_grow();
+      i = find_first_non_full(hash);
+    }
+    return {i, false};
+  }
+
+  void insert_at(size_t i, uint64_t hash, T value) {
+    growth_left -= ctrl[i] == EMPTY;
+    set_ctrl(i, h2(hash));
+    slots[i] = Slot{hash, std::move(value)};
+    ++size_;
+  }
+
+  // inserts without checking if the element already exists
+  void insert(uint64_t hash, T value) {
+    size_t i = find_or_prepare_insert(hash, [](const T&) { return false; }).first;
+    insert_at(i, hash, std::move(value));
+  }
+
+  void erase_at(size_t i) {
+    set_ctrl(i, DELETED);
+    --size_;
+  }
+
+  Slot& slot(size_t i) { return slots[i]; }
+  const Slot& slot(size_t i) const { return slots[i]; }
+
+  // calls f(Slot&) on each element
+  template <typename F>
+  void for_each(F f) {
+    for (size_t i = 0; i < capacity_; ++i) {
+      if (ctrl[i] >= 0) {
+        f(slots[i]);
+      }
+    }
+  }
+
+  void clear() {
+    ctrl.reset();
+    slots.reset();
+    capacity_ = 0;
+    size_ = 0;
+    growth_left = 0;
+  }
+};
+
+} // namespace choose
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <random>
+
+#include "likely_unlikely.hpp"
+
+namespace choose {
+
+namespace hash {
+
+// 64x64 -> 128 bit multiply, returning the low and high halves xored together
+uint64_t mum(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t)a * b;
+  return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+  uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t)a, lb = (uint32_t)b;
+  uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+  uint64_t t = rl + (rm0 << 32);
+  uint64_t c = t < rl;
+  uint64_t lo = t + (rm1 << 32);
+  c += lo < t;
+  uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+  return lo ^ hi;
+#endif
+}
+
+// a bijective finalizer (from murmur3). spreads a weak hash over all bits
+uint64_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+namespace {
+
+uint64_t read8(const char* p) {
+  uint64_t v; // NOLINT
+  std::memcpy(&v, p, 8);
+  return v;
+}
+
+uint64_t read4(const char* p) {
+  uint32_t v; // NOLINT
+  std::memcpy(&v, p, 4);
+  return v;
+}
+
+uint64_t read3(const char* p, size_t k) {
+  const unsigned char* u = (const unsigned char*)p;
+  return ((uint64_t)u[0] << 16) | ((uint64_t)u[k >> 1] << 8) | u[k - 1];
+}
+
+constexpr uint64_t SECRET[4] = {0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL, 0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL};
+
+} // namespace
+
+// seeded hash of a byte string. this is wyhash (final version 4.2)
+uint64_t bytes(const char* p, size_t len, uint64_t seed) {
+  seed ^= mum(seed ^ SECRET[0], SECRET[1]);
+  uint64_t a, b; // NOLINT
+  if (likely(len <= 16)) {
+    if (likely(len >= 4)) {
+      a = (read4(p) << 32) | read4(p + ((len >> 3) << 2));
+      b = (read4(p + len - 4) << 32) | read4(p + len - 4 - ((len >> 3) << 2));
+    } else if (likely(len > 0)) {
+      a = read3(p, len);
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    size_t i = len;
+    if (unlikely(i > 48)) {
+      uint64_t see1 = seed, see2 = seed;
+      do {
+        seed = mum(read8(p) ^ SECRET[1], read8(p + 8) ^ seed);
+        see1 = mum(read8(p + 16) ^ SECRET[2], read8(p + 24) ^ see1);
+        see2 = mum(read8(p + 32) ^ SECRET[3], read8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (likely(i > 48));
+      seed ^= see1 ^ see2;
+    }
+    while (unlikely(i > 16)) {
+      seed = mum(read8(p) ^ SECRET[1], read8(p + 8) ^ seed);
+      i -= 16;
+      p += 16;
+    }
+    a = read8(p + i - 16);
+    b = read8(p + i - 8);
+  }
+  a ^= SECRET[1];
+  b ^= seed;
+#ifdef __SIZEOF_INT128__
+  __uint128_t r = (__uint128_t)a * b;
+  a = (uint64_t)r;
+  b = (uint64_t)(r >> 64);
+#else
+  uint64_t m = mum(a, b);
+  a = m;
+  b = m * SECRET[2];
+#endif
+  return mum(a ^ SECRET[0] ^ len, b ^ SECRET[1]);
+}
+
+// a seed which differs on each run, so the hashes can't be targeted by crafted input
+uint64_t random_seed() {
+  std::random_device rd;
+  return ((uint64_t)rd() << 32) ^ rd();
+}
+
+} // namespace hash
+
+} // namespace choose
@@ -35,7 +35,7 @@ struct BatchOutputStream {
       qo.write_output(args.output, args.bout_delimiter);
     }
     first_within_batch = false;
-    qo.write_output(args.output, t.buffer);
+    qo.write_output(args.output, t.buffer_begin(), t.buffer_end());
   }
 
   void finish_batch() {
@@ -57,6 +57,7 @@ struct BatchOutputStream {
 struct UIState {
   choose::Arguments args;
   std::vector<choose::Token> tokens;
+  choose::Arena arena; // owns the bytes of the tokens
   BatchOutputStream os;
 
   // ncurses
@@ -351,8 +352,8 @@ again:
         // 2 leaves a space for the indicator '>' and a single space
         const int INITIAL_X = selection_text_space + 2;
         int x = INITIAL_X;
-        const char* pos = &*tokens[y + scroll_position].buffer.cbegin();
-        const char* end = &*tokens[y + scroll_position].buffer.cend();
+        const char* pos = tokens[y + scroll_position].buffer_begin();
+        const char* end = tokens[y + scroll_position].buffer_end();
 
         // ============================ draw token =============================
 
@@ -420,7 +421,7 @@ again:
         if (invisible_only) {
           const choose::Token& token = tokens[y + scroll_position];
           wattron(selection_window.get(), A_DIM);
-          mvwprintw(selection_window.get(), y, INITIAL_X, "\\s{%d bytes}", (int)(token.buffer.end() - token.buffer.begin()));
+          mvwprintw(selection_window.get(), y, INITIAL_X, "\\s{%d bytes}", (int)token.size);
           wattroff(selection_window.get(), A_DIM);
         }
 
@@ -472,6 +473,7 @@ int main(int argc, char* const* argv) {
   UIState state{
       std::move(args),                 //
       std::move(tokens_result.tokens), //
+      std::move(tokens_result.arena),  //
       BatchOutputStream(state.args),
   };
 
@@ -496,8 +498,8 @@ int main(int argc, char* const* argv) {
       // best to do this association at the end, as the indices are moved
       // around by sorting and uniqueness
       for (int i = 0; i < (int)state.tokens.size(); ++i) {
-        if (std::equal(state.tokens[i].buffer.cbegin(), state.tokens[i].buffer.cend(), //
-                       tokens_result.initial_selected_token->buffer.cbegin(), tokens_result.initial_selected_token->buffer.cend())) {
+        if (std::equal(state.tokens[i].buffer_begin(), state.tokens[i].buffer_end(), //
+                       tokens_result.initial_selected_token->buffer_begin(), tokens_result.initial_selected_token->buffer_end())) {
           state.selection_position = i;
           break;
         }
@@ -1,6 +1,9 @@
 #pragma once
+#include <cstdint>
+#include <cstring>
 #include <limits>
 #include <optional>
+#include <string>
 #include <tuple>
 #include <type_traits>
 
@@ -151,5 +154,43 @@ std::tuple<T, std::optional<T>> parse_number_pair(OnErr onErr, const char* str)
   return {first, second};
 }
 
+// a number of milliseconds, from a duration with a unit suffix: ms, s, m, or h.
+// without a suffix it's seconds
+template <typename OnErr>
+uint64_t parse_duration_ms(OnErr onErr, const char* str) {
+  const char* unit = str;
+  while (in(*unit, '0', '9')) {
+    ++unit;
+  }
+  uint64_t multiplier; // NOLINT
+  if (*unit == '\0' || strcmp(unit, "s") == 0) {
+    multiplier = 1000;
+  } else if (strcmp(unit, "ms") == 0) {
+    multiplier = 1;
+  } else if (strcmp(unit, "m") == 0) {
+    multiplier = 60 * 1000;
+  } else if (strcmp(unit, "h") == 0) {
+    multiplier = 60 * 60 * 1000;
+  } else {
+    onErr();
+    return 0;
+  }
+
+  bool erred = false;
+  auto local_on_err = [&]() {
+    erred = true;
+    onErr();
+  };
+  uint64_t count = parse_number<uint64_t>(local_on_err, std::string(str, unit).c_str(), false);
+  if (erred) {
+    return 0;
+  }
+  if (auto result = mul_overflow(count, multiplier)) {
+    return *result;
+  }
+  onErr();
+  return 0;
+}
+
 } // namespace num
 } // namespace choose
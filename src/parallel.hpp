@@ -0,0 +1,360 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace choose {
+
+// a small amount of built in parallelism for sorting, over std::thread. this
+// doesn't depend on the standard library's parallel algorithms, which
+// silently run single threaded unless TBB happens to be available
+
+namespace parallel {
+
+struct Threads {
+  unsigned count = 1;
+  // pin each worker thread to one of the cpus this process is allowed to run on
+  bool pin = false;
+};
+
+// the cpus this process is allowed to run on (e.g. from taskset or a cpuset)
+std::vector<int> allowed_cpus() {
+  std::vector<int> ret;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int i = 0; i < CPU_SETSIZE; ++i) {
+      if (CPU_ISSET(i, &set)) {
+        ret.push_back(i);
+      }
+    }
+  }
+#endif
+  return ret;
+}
+
+unsigned default_thread_count() {
+  size_t ret = allowed_cpus().size();
+  if (ret == 0) {
+    ret = std::thread::hardware_concurrency();
+  }
+  return ret == 0 ? 1 : ret;
+}
+
+namespace {
+
+void pin_current_thread(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set); // best effort
+#else
+  (void)cpu;
+#endif
+}
+
+} // namespace
+
+// calls f(i) for each i in [0, n). tasks are taken one at a time from a shared
+// counter, so a thread that finishes its task early takes on the next one;
+// uneven tasks still balance out. the calling thread also does work
+template <typename F>
+void run(const Threads& threads, size_t n, F f) {
+  size_t worker_count = std::min<size_t>(threads.count, n);
+  if (worker_count <= 1) {
+    for (size_t i = 0; i < n; ++i) {
+      f(i);
+    }
+    return;
+  }
+
+  std::atomic<size_t> next{0};
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  std::vector<int> cpus;
+  if (threads.pin) {
+    cpus = allowed_cpus();
+  }
+
+  auto work = [&](size_t worker) {
+    // the calling thread isn't pinned, since that would outlast this call
+    if (worker != 0 && !cpus.empty()) {
+      pin_current_thread(cpus[worker % cpus.size()]);
+    }
+    try {
+      size_t i; // NOLINT
+      while ((i = next++) < n) {
+        f(i);
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!error) {
+        error = std::current_exception();
+      }
+      next = n; // stop the others early
+    }
+  };
+
+  std::vector<std::thread> workers;
+  workers.reserve(worker_count - 1);
+  for (size_t w = 1; w < worker_count; ++w) {
+    workers.emplace_back(work, w);
+  }
+  work(0);
+  for (std::thread& t : workers) {
+    t.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+namespace {
+
+// the number of elements from a which are in the first k elements of the
+// stable merge of a and b (a first on ties)
+template <typename T, typename Comp>
+size_t co_rank(size_t k, const T* a, size_t a_size, const T* b, size_t b_size, Comp& comp) {
+  size_t lo = k > b_size ? k - b_size : 0;
+  size_t hi = std::min(k, a_size);
+  while (lo < hi) {
+    size_t i = lo + (hi - lo) / 2;
+    size_t j = k - i;
+    if (!comp(b[j - 1], a[i])) {
+      lo = i + 1; // a[i] comes before b[j - 1]
+    } else {
+      hi = i;
+    }
+  }
+  return lo;
+}
+
+constexpr size_t MIN_PARALLEL_SORT = 1 << 14;
+
+} // namespace
+
+// the range is made of sorted runs, runs[i] from bounds[i] to bounds[i + 1].
+// they are merged pairwise in rounds. each merge is split into pieces at points
+// found by binary search, so that the last rounds (which have only a few merges)
+// still use every thread. stable; on ties the earlier run comes first
+template <typename T, typename Comp>
+void merge_runs(const Threads& threads, T* data, std::vector<size_t> bounds, Comp comp) {
+  if (bounds.size() <= 2) {
+    return;
+  }
+
+  struct Piece {
+    size_t a_begin;
+    size_t a_end;
+    size_t b_begin;
+    size_t b_end;
+    size_t out;
+  };
+
+  size_t n = bounds.back() - bounds.front();
+  std::vector<T> buf(bounds.back());
+  T* src = data;
+  T* dst = buf.data();
+  while (bounds.size() > 2) {
+    size_t runs = bounds.size() - 1;
+    std::vector<size_t> next_bounds;
+    std::vector<Piece> pieces;
+    for (size_t r = 0; r < runs; r += 2) {
+      size_t lo = bounds[r];
+      size_t mid = bounds[r + 1];
+      size_t hi = r + 1 < runs ? bounds[r + 2] : mid; // a lone run at the end is just moved
+      next_bounds.push_back(lo);
+      size_t length = hi - lo;
+      size_t piece_count = std::max<size_t>(1, (length * threads.count + n - 1) / n);
+      size_t prev_i = 0;
+      for (size_t k = 0; k < piece_count; ++k) {
+        size_t out_end = length * (k + 1) / piece_count;
+        size_t i = co_rank(out_end, src + lo, mid - lo, src + mid, hi - mid, comp);
+        size_t out_begin = length * k / piece_count;
+        pieces.push_back(Piece{lo + prev_i, lo + i, mid + (out_begin - prev_i), mid + (out_end - i), lo + out_begin});
+        prev_i = i;
+      }
+    }
+    next_bounds.push_back(bounds.back());
+
+    run(threads, pieces.size(), [&](size_t i) {
+      const Piece& p = pieces[i];
+      std::merge(std::make_move_iterator(src + p.a_begin), std::make_move_iterator(src + p.a_end), //
+                 std::make_move_iterator(src + p.b_begin), std::make_move_iterator(src + p.b_end), //
+                 dst + p.out, comp);
+    });
+    std::swap(src, dst);
+    bounds = std::move(next_bounds);
+  }
+
+  if (src != data) {
+    std::move(src + bounds.front(), src + bounds.back(), data + bounds.front());
+  }
+}
+
+// a stable merge sort. the range is split into a run for each thread, and the
+// runs are sorted in parallel, then merged
+template <typename it, typename Comp>
+void sort(const Threads& threads, it begin, it end, Comp comp) {
+  size_t n = end - begin;
+  if (threads.count <= 1 || n < MIN_PARALLEL_SORT) {
+    std::stable_sort(begin, end, comp);
+    return;
+  }
+
+  auto* data = &*begin;
+  size_t run_count = threads.count;
+  std::vector<size_t> bounds(run_count + 1);
+  for (size_t i = 0; i <= run_count; ++i) {
+    bounds[i] = n * i / run_count;
+  }
+  run(threads, run_count, [&](size_t i) { //
+    std::stable_sort(data + bounds[i], data + bounds[i + 1], comp);
+  });
+  merge_runs(threads, data, std::move(bounds), comp);
+}
+
+// a pool of threads which run tasks in the background, while the thread that
+// owns it carries on with something else (e.g. reading the input)
+struct Background {
+ private:
+  std::mutex mutex;
+  std::condition_variable task_cv; // a task is available or stopping
+  std::condition_variable idle_cv; // pending reached 0
+  std::deque<std::function<void()>> tasks;
+  size_t pending = 0; // queued or running
+  bool stopping = false;
+  std::exception_ptr error;
+  std::vector<std::thread> workers;
+
+  void work(int cpu) {
+    if (cpu >= 0) {
+      pin_current_thread(cpu);
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      task_cv.wait(lock, [&] { return stopping || !tasks.empty(); });
+      if (stopping) {
+        return;
+      }
+      std::function<void()> task = std::move(tasks.front());
+      tasks.pop_front();
+      lock.unlock();
+      std::exception_ptr task_error;
+      try {
+        task();
+      } catch (...) {
+        task_error = std::current_exception();
+      }
+      lock.lock();
+      if (task_error && !error) {
+        error = task_error;
+      }
+      if (--pending == 0) {
+        idle_cv.notify_all();
+      }
+    }
+  }
+
+ public:
+  // the calling thread is counted as one of the threads, so one fewer is started
+  explicit Background(const Threads& threads) {
+    std::vector<int> cpus;
+    if (threads.pin) {
+      cpus = allowed_cpus();
+    }
+    for (size_t w = 1; w < threads.count; ++w) {
+      int cpu = cpus.empty() ? -1 : cpus[w % cpus.size()];
+      workers.emplace_back([this, cpu] { work(cpu); });
+    }
+  }
+
+  Background(const Background&) = delete;
+  Background& operator=(const Background&) = delete;
+
+  // tasks which haven't started are dropped
+  ~Background() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    task_cv.notify_all();
+    for (std::thread& t : workers) {
+      t.join();
+    }
+  }
+
+  // with no background threads, the task is run now
+  void submit(std::function<void()> task) {
+    if (workers.empty()) {
+      task();
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      tasks.push_back(std::move(task));
+      ++pending;
+    }
+    task_cv.notify_one();
+  }
+
+  // waits for every submitted task to finish. rethrows the first exception
+  // from a task since the last wait
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle_cv.wait(lock, [&] { return pending == 0; });
+    if (error) {
+      std::exception_ptr e = std::move(error);
+      error = nullptr;
+      std::rethrow_exception(e);
+    }
+  }
+
+  // calls f(i) for each i in [0, n) and waits for them. like run, the calling
+  // thread takes a share of the work, but the threads are kept between calls
+  template <typename F>
+  void run(size_t n, F f) {
+    std::atomic<size_t> next{0};
+    auto work = [&]() {
+      size_t i; // NOLINT
+      while ((i = next++) < n) {
+        f(i);
+      }
+    };
+    size_t helpers = std::min(workers.size(), n == 0 ? 0 : n - 1);
+    for (size_t w = 0; w < helpers; ++w) {
+      submit(work);
+    }
+    std::exception_ptr caller_error;
+    try {
+      work();
+    } catch (...) {
+      caller_error = std::current_exception();
+      next = n; // stop the others early
+    }
+    wait(); // the tasks refer to this frame
+    if (caller_error) {
+      std::rethrow_exception(caller_error);
+    }
+  }
+};
+
+} // namespace parallel
+
+} // namespace choose
@@ -0,0 +1,538 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include "algo_utils.hpp"
+#include "arena.hpp"
+#include "args.hpp"
+#include "likely_unlikely.hpp"
+#include "parallel.hpp"
+
+namespace choose {
+
+// comparing tokens directly re-parses both fields on every comparison. instead,
+// each field is turned into a key once. a key is a byte string whose memcmp
+// order (where a prefix is less) is the same as the comparison type's order.
+// the keys are sorted, and then the tokens are put in that order.
+
+namespace sort_key {
+
+namespace {
+
+constexpr unsigned char NEGATIVE = 0;
+constexpr unsigned char ZERO = 1;
+constexpr unsigned char POSITIVE = 2;
+constexpr size_t NUMERIC_HEADER_SIZE = 5; // class byte + integer part length
+
+} // namespace
+
+// numeric_compare compares the integer part (without the sign, leading zeros or
+// thousands seps) by its length and then its bytes, then the fraction part with
+// trailing zeros ignored. so the key is:
+//   - a class byte: negative, zero or positive
+//   - the integer part length, as 4 big endian bytes
+//   - the integer part bytes, then the fraction part bytes
+// numeric_compare compares chars, which are signed. so bytes are offset by 0x80.
+// for negative values everything after the class byte is inverted, then ends
+// with a 0xFF; this is so a larger magnitude or a longer fraction is less
+void encode_numeric(const char* begin, const char* end, std::vector<unsigned char>& out) {
+  out.resize(NUMERIC_HEADER_SIZE);
+  bool negative = begin != end && *begin == '-';
+  if (negative) {
+    ++begin;
+  }
+  while (begin != end && (*begin == '0' || *begin == ',')) {
+    ++begin;
+  }
+  for (; begin != end && *begin != '.'; ++begin) {
+    if (unlikely(*begin == STR_END)) {
+      begin = end; // same quirk as numeric_compare
+      break;
+    }
+    if (*begin != ',') {
+      out.push_back((unsigned char)*begin ^ 0x80);
+    }
+  }
+  uint32_t integer_length = out.size() - NUMERIC_HEADER_SIZE;
+  if (begin != end) {
+    ++begin; // skip the decimal point
+    const char* fraction_end = end;
+    while (fraction_end > begin && fraction_end[-1] == '0') {
+      --fraction_end;
+    }
+    for (; begin != fraction_end; ++begin) {
+      out.push_back((unsigned char)*begin ^ 0x80);
+    }
+  }
+
+  if (out.size() == NUMERIC_HEADER_SIZE) {
+    out.resize(1); // -0 and 0 are the same
+    out[0] = ZERO;
+    return;
+  }
+
+  out[0] = negative ? NEGATIVE : POSITIVE;
+  for (size_t i = 0; i < 4; ++i) {
+    out[1 + i] = (unsigned char)(integer_length >> (8 * (3 - i)));
+  }
+
+  if (negative) {
+    for (size_t i = 1; i < out.size(); ++i) {
+      out[i] = ~out[i];
+      if (i >= NUMERIC_HEADER_SIZE && out[i] == 0xFF) {
+        // only the terminator is 0xFF. this only affects bytes that aren't digits
+        out[i] = 0xFE;
+      }
+    }
+    out.push_back(0xFF);
+  }
+}
+
+// general_numeric_key already has the right order as an integer
+void encode_general_numeric(const char* begin, const char* end, std::vector<unsigned char>& out) {
+  uint64_t key = general_numeric_key(begin, end);
+  out.resize(8);
+  for (size_t i = 0; i < 8; ++i) {
+    out[i] = (unsigned char)(key >> (8 * (7 - i)));
+  }
+}
+
+// the first 8 bytes of a key, big endian and zero padded. comparing these as
+// integers is the same as comparing the first 8 bytes (from PostgreSQL's
+// "abbreviated keys")
+uint64_t prefix(const unsigned char* key, uint32_t length) {
+  unsigned char buf[8] = {0};
+  std::memcpy(buf, key, length < 8 ? length : 8);
+  uint64_t ret = 0;
+  for (size_t i = 0; i < 8; ++i) {
+    ret = (ret << 8) | buf[i];
+  }
+  return ret;
+}
+
+// kept small so the sort mostly stays within the entries, only looking at the
+// key bytes (scattered elsewhere in memory) when the prefixes are the same
+struct Entry {
+  uint64_t prefix;
+  const unsigned char* key;
+  uint32_t length;
+  uint32_t index; // position in the elements being sorted
+
+  Entry() = default;
+  Entry(const unsigned char* key, uint32_t length, uint32_t index) //
+      : prefix(sort_key::prefix(key, length)), key(key), length(length), index(index) {}
+};
+
+// three way comparison of the keys
+int compare(const Entry& lhs, const Entry& rhs) {
+  if (lhs.prefix != rhs.prefix) {
+    return lhs.prefix < rhs.prefix ? -1 : 1;
+  }
+  uint32_t n = std::min(lhs.length, rhs.length);
+  if (n > 8) {
+    // the first 8 bytes are the same
+    int ret = std::memcmp(lhs.key + 8, rhs.key + 8, n - 8);
+    if (ret != 0) {
+      return ret;
+    }
+  }
+  return (lhs.length > rhs.length) - (lhs.length < rhs.length);
+}
+
+// multikey quicksort (Bentley and Sedgewick). a 3 way partition is done on
+// one byte at a time, and the middle partition moves to the next byte. unlike a
+// comparison sort, bytes already known to be equal are never compared again,
+// which matters when many keys share a long prefix (timestamps, hostnames)
+
+namespace {
+
+constexpr ptrdiff_t MULTIKEY_SMALL = 32;
+
+// the byte of the key at depth, or -1 past the end
+int byte_at(const Entry& e, uint32_t depth) {
+  if (depth >= e.length) {
+    return -1;
+  }
+  if (depth < 8) {
+    return (int)((e.prefix >> (8 * (7 - depth))) & 0xFF);
+  }
+  return e.key[depth];
+}
+
+// partitions [begin, end) on the byte at depth, such that [lt, gt) has the
+// pivot byte. returns the pivot byte
+int partition(Entry* begin, Entry* end, uint32_t depth, Entry*& lt, Entry*& gt) {
+  int a = byte_at(begin[0], depth);
+  int b = byte_at(begin[(end - begin) / 2], depth);
+  int c = byte_at(end[-1], depth);
+  int pivot = std::max(std::min(a, b), std::min(std::max(a, b), c)); // median
+  lt = begin;
+  gt = end;
+  Entry* pos = begin;
+  while (pos < gt) {
+    int ch = byte_at(*pos, depth);
+    if (ch < pivot) {
+      std::swap(*lt++, *pos++);
+    } else if (ch > pivot) {
+      std::swap(*pos, *--gt);
+    } else {
+      ++pos;
+    }
+  }
+  return pivot;
+}
+
+// equal keys are ordered by index, ascending or descending
+void multikey_quicksort(Entry* begin, Entry* end, uint32_t depth, bool index_descending) {
+  auto index_less = [index_descending](const Entry& lhs, const Entry& rhs) -> bool { //
+    return index_descending ? lhs.index > rhs.index : lhs.index < rhs.index;
+  };
+  while (end - begin > MULTIKEY_SMALL) {
+    Entry* lt;  // NOLINT
+    Entry* gt;  // NOLINT
+    int pivot = partition(begin, end, depth, lt, gt);
+    Entry* middle_end = gt;
+    if (pivot < 0) {
+      // every key in the middle ended here, so they are equal
+      std::sort(lt, gt, index_less);
+      middle_end = lt;
+    }
+    struct Part {
+      Entry* begin;
+      Entry* end;
+      uint32_t depth;
+    };
+    Part parts[3] = {{begin, lt, depth}, {lt, middle_end, depth + 1}, {gt, end, depth}};
+    // only the largest part continues here. the others are at most half the
+    // size, so the recursion is at most log n deep
+    Part* largest = std::max_element(std::begin(parts), std::end(parts), [](const Part& lhs, const Part& rhs) { //
+      return lhs.end - lhs.begin < rhs.end - rhs.begin;
+    });
+    for (Part& part : parts) {
+      if (&part != largest) {
+        multikey_quicksort(part.begin, part.end, part.depth, index_descending);
+      }
+    }
+    begin = largest->begin;
+    end = largest->end;
+    depth = largest->depth;
+  }
+  std::sort(begin, end, [&](const Entry& lhs, const Entry& rhs) -> bool {
+    int cmp = compare(lhs, rhs);
+    return cmp < 0 || (cmp == 0 && index_less(lhs, rhs));
+  });
+}
+
+} // namespace
+
+// the first few partition steps are done up front, until the work is split
+// into enough independent ranges. those are then sorted in parallel
+void string_sort(const parallel::Threads& threads, std::vector<Entry>& entries, bool index_descending) {
+  struct Range {
+    Entry* begin;
+    Entry* end;
+    uint32_t depth;
+  };
+  const ptrdiff_t grain = std::max<ptrdiff_t>(entries.size() / 64, 1 << 12);
+  std::vector<Range> to_split{Range{entries.data(), entries.data() + entries.size(), 0}};
+  std::vector<Range> ranges;
+  while (!to_split.empty()) {
+    Range r = to_split.back();
+    to_split.pop_back();
+    if (r.end - r.begin <= grain) {
+      ranges.push_back(r);
+      continue;
+    }
+    Entry* lt;  // NOLINT
+    Entry* gt;  // NOLINT
+    int pivot = partition(r.begin, r.end, r.depth, lt, gt);
+    to_split.push_back(Range{r.begin, lt, r.depth});
+    to_split.push_back(Range{gt, r.end, r.depth});
+    if (pivot < 0) {
+      ranges.push_back(Range{lt, gt, r.depth}); // all equal. only ordered by index
+    } else {
+      to_split.push_back(Range{lt, gt, r.depth + 1});
+    }
+  }
+  // largest first, so a large range isn't started last
+  std::sort(ranges.begin(), ranges.end(), [](const Range& lhs, const Range& rhs) { return lhs.end - lhs.begin > rhs.end - rhs.begin; });
+  parallel::run(threads, ranges.size(), [&](size_t i) { //
+    multikey_quicksort(ranges[i].begin, ranges[i].end, ranges[i].depth, index_descending);
+  });
+}
+
+namespace {
+
+// on average, runs must be at least this long for merging them to be used
+constexpr size_t PRESORTED_MIN_RUN_LENGTH = 64;
+
+} // namespace
+
+// input is often already sorted, or mostly sorted (e.g. by timestamp). like
+// timsort, the entries are split into runs which are in order, or strictly in
+// reverse order (which are reversed in place, keeping it stable). if there are
+// only a few runs then they are merged, which is O(n) for sorted input. returns
+// false if there are too many runs; then the entries are still the same set
+// but some may have moved
+bool merge_presorted(const parallel::Threads& threads, std::vector<Entry>& entries, bool reversed) {
+  auto less = [reversed](const Entry& lhs, const Entry& rhs) -> bool {
+    int cmp = compare(lhs, rhs);
+    return reversed ? cmp > 0 : cmp < 0;
+  };
+  size_t n = entries.size();
+  size_t max_runs = std::max<size_t>(n / PRESORTED_MIN_RUN_LENGTH, 1);
+  std::vector<size_t> bounds{0};
+  size_t i = 0;
+  while (i < n) {
+    if (bounds.size() > max_runs) {
+      return false;
+    }
+    size_t j = i + 1;
+    if (j < n && less(entries[j], entries[i])) {
+      while (j < n && less(entries[j], entries[j - 1])) {
+        ++j;
+      }
+      std::reverse(entries.begin() + i, entries.begin() + j);
+    } else {
+      while (j < n && !less(entries[j], entries[j - 1])) {
+        ++j;
+      }
+    }
+    bounds.push_back(j);
+    i = j;
+  }
+  // the entries are in index order, so ties going to the earlier run is stable
+  parallel::merge_runs(threads, entries.data(), std::move(bounds), less);
+  return true;
+}
+
+namespace {
+
+// the entries for the indices, sorted by key. returns the indices in order
+template <typename T>
+std::vector<uint32_t> key_order(const parallel::Threads& threads, const std::vector<T>& elems, const std::vector<uint32_t>& indices, Comparison type, bool reversed) {
+  std::vector<Entry> entries;
+  entries.reserve(indices.size());
+  Arena arena; // the keys which aren't the field itself
+  std::vector<unsigned char> scratch;
+  for (uint32_t i : indices) {
+    const char* begin = elems[i].cbegin();
+    const char* end = elems[i].cend();
+    if (type == lexicographical) {
+      // the field is the key
+      entries.emplace_back((const unsigned char*)begin, (uint32_t)(end - begin), i);
+      continue;
+    }
+    if (type == numeric) {
+      encode_numeric(begin, end, scratch);
+    } else {
+      encode_general_numeric(begin, end, scratch);
+    }
+    const char* scratch_begin = (const char*)scratch.data();
+    const char* key = arena.store(scratch_begin, scratch_begin + scratch.size());
+    entries.emplace_back((const unsigned char*)key, (uint32_t)scratch.size(), i);
+  }
+
+  if (!merge_presorted(threads, entries, reversed)) {
+    // reversed keeps equal keys in their original order. so sort with the
+    // index descending, then reverse everything
+    string_sort(threads, entries, reversed);
+    if (reversed) {
+      std::reverse(entries.begin(), entries.end());
+    }
+  }
+
+  std::vector<uint32_t> ret;
+  ret.reserve(entries.size());
+  for (const Entry& e : entries) {
+    ret.push_back(e.index);
+  }
+  return ret;
+}
+
+struct FixedPoint {
+  int64_t value;
+  uint32_t fraction_digits;
+};
+
+// parses a plain number, ^-?[0-9,]*(?:\.[0-9]*)?$, if it fits in 64 bits.
+// trailing zeros in the fraction are dropped
+bool parse_fixed_point(const char* begin, const char* end, FixedPoint& out) {
+  bool negative = begin != end && *begin == '-';
+  if (negative) {
+    ++begin;
+  }
+  const char* point = std::find(begin, end, '.');
+  const char* digits_end = end;
+  if (point != end) {
+    while (digits_end > point + 1 && digits_end[-1] == '0') {
+      --digits_end;
+    }
+  }
+  constexpr uint64_t LIMIT = std::numeric_limits<int64_t>::max();
+  uint64_t magnitude = 0;
+  uint32_t fraction_digits = 0;
+  for (const char* pos = begin; pos < digits_end; ++pos) {
+    char ch = *pos;
+    if (pos == point || (ch == ',' && pos < point)) {
+      continue;
+    }
+    if (ch < '0' || ch > '9') {
+      return false;
+    }
+    if (magnitude > (LIMIT - (ch - '0')) / 10) {
+      return false;
+    }
+    magnitude = magnitude * 10 + (ch - '0');
+    fraction_digits += pos > point;
+  }
+  out.value = negative ? -(int64_t)magnitude : (int64_t)magnitude;
+  out.fraction_digits = fraction_digits;
+  return true;
+}
+
+struct RadixEntry {
+  uint64_t key;
+  uint32_t index;
+};
+
+// lsd radix sort, one byte per pass. stable. passes where every key has the
+// same byte are skipped
+void radix_sort(std::vector<RadixEntry>& entries) {
+  if (entries.empty()) {
+    return;
+  }
+  std::vector<size_t> counts(8 * 256);
+  for (const RadixEntry& e : entries) {
+    for (size_t pass = 0; pass < 8; ++pass) {
+      ++counts[pass * 256 + ((e.key >> (8 * pass)) & 0xFF)];
+    }
+  }
+  std::vector<RadixEntry> buf(entries.size());
+  for (size_t pass = 0; pass < 8; ++pass) {
+    size_t* c = &counts[pass * 256];
+    if (c[(entries[0].key >> (8 * pass)) & 0xFF] == entries.size()) {
+      continue;
+    }
+    size_t sum = 0;
+    for (size_t i = 0; i < 256; ++i) {
+      size_t count = c[i];
+      c[i] = sum;
+      sum += count;
+    }
+    for (const RadixEntry& e : entries) {
+      buf[c[(e.key >> (8 * pass)) & 0xFF]++] = e;
+    }
+    entries.swap(buf);
+  }
+}
+
+// for numeric sorting. most of the time every token is a plain integer or
+// decimal. those are scaled to a common number of fraction digits, then radix
+// sorted as integers. the rest (which don't parse, or don't fit) are sorted by
+// their keys and merged in. returns false if too few tokens parse for this to
+// be worth it
+template <typename T>
+bool numeric_radix_order(const parallel::Threads& threads, const std::vector<T>& elems, bool reversed, std::vector<uint32_t>& order) {
+  static constexpr int64_t POW10[19] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000, 10000000000, 100000000000, 1000000000000, 10000000000000, 100000000000000, 1000000000000000, 10000000000000000, 100000000000000000, 1000000000000000000};
+
+  std::vector<FixedPoint> parsed(elems.size());
+  std::vector<uint32_t> rest;
+  uint32_t max_fraction_digits = 0;
+  for (uint32_t i = 0; i < elems.size(); ++i) {
+    if (parse_fixed_point(elems[i].cbegin(), elems[i].cend(), parsed[i])) {
+      max_fraction_digits = std::max(max_fraction_digits, parsed[i].fraction_digits);
+    } else {
+      parsed[i].fraction_digits = std::numeric_limits<uint32_t>::max();
+      rest.push_back(i);
+      if (rest.size() > elems.size() / 2) {
+        return false;
+      }
+    }
+  }
+
+  std::vector<RadixEntry> entries;
+  entries.reserve(elems.size() - rest.size());
+  for (uint32_t i = 0; i < elems.size(); ++i) {
+    const FixedPoint& fp = parsed[i];
+    if (fp.fraction_digits == std::numeric_limits<uint32_t>::max()) {
+      continue;
+    }
+    uint32_t shift = max_fraction_digits - fp.fraction_digits;
+    int64_t scaled; // NOLINT
+    if (shift >= sizeof(POW10) / sizeof(*POW10) || __builtin_mul_overflow(fp.value, POW10[shift], &scaled)) {
+      rest.push_back(i); // doesn't fit once scaled
+      continue;
+    }
+    uint64_t key = (uint64_t)scaled ^ ((uint64_t)1 << 63); // signed to unsigned order
+    entries.push_back(RadixEntry{reversed ? ~key : key, i});
+  }
+  parsed = std::vector<FixedPoint>();
+  if (rest.size() > elems.size() / 2) {
+    return false;
+  }
+
+  radix_sort(entries);
+  std::vector<uint32_t> radix_order;
+  radix_order.reserve(entries.size());
+  for (const RadixEntry& e : entries) {
+    radix_order.push_back(e.index);
+  }
+  entries = std::vector<RadixEntry>();
+
+  std::sort(rest.begin(), rest.end()); // scaling failures were appended out of order
+  std::vector<uint32_t> rest_order = key_order(threads, elems, rest, numeric, reversed);
+
+  order.resize(elems.size());
+  std::merge(radix_order.begin(), radix_order.end(), rest_order.begin(), rest_order.end(), order.begin(), [&](uint32_t lhs, uint32_t rhs) -> bool {
+    const T& l = elems[lhs];
+    const T& r = elems[rhs];
+    if (reversed ? numeric_compare(r.cbegin(), r.cend(), l.cbegin(), l.cend()) : numeric_compare(l.cbegin(), l.cend(), r.cbegin(), r.cend())) {
+      return true;
+    }
+    if (reversed ? numeric_compare(l.cbegin(), l.cend(), r.cbegin(), r.cend()) : numeric_compare(r.cbegin(), r.cend(), l.cbegin(), l.cend())) {
+      return false;
+    }
+    return lhs < rhs;
+  });
+  return true;
+}
+
+} // namespace
+
+// sorts the elements by their field (cbegin() to cend()) according to the
+// comparison type. elements with equal keys keep their original order, so this
+// is always stable
+template <typename T>
+void sort(const parallel::Threads& threads, std::vector<T>& elems, Comparison type, bool reversed) {
+  if (elems.size() > std::numeric_limits<uint32_t>::max()) {
+    throw std::runtime_error("too many tokens to sort");
+  }
+
+  std::vector<uint32_t> order;
+  if (type != numeric || !numeric_radix_order(threads, elems, reversed, order)) {
+    std::vector<uint32_t> indices(elems.size());
+    for (uint32_t i = 0; i < elems.size(); ++i) {
+      indices[i] = i;
+    }
+    order = key_order(threads, elems, indices, type, reversed);
+  }
+
+  std::vector<T> sorted;
+  sorted.reserve(elems.size());
+  for (uint32_t i : order) {
+    sorted.push_back(std::move(elems[i]));
+  }
+  elems = std::move(sorted);
+}
+
+} // namespace sort_key
+
+} // namespace choose
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "algo_utils.hpp"
+
+namespace choose {
+
+// external sorting. when the tokens being sorted exceed the memory budget
+// (--max-memory), they are sorted and written to a temporary file as a run.
+// at the end, the runs are merged
+
+namespace spill {
+
+// the number of runs merged at once. past this, the runs so far are merged into
+// a single run, which keeps the number of open files down
+constexpr size_t MAX_MERGE_RUNS = 64;
+
+// a temporary file in $TMPDIR (or /tmp). it's unlinked right away, so it's
+// removed once closed, even if choose doesn't exit normally
+struct TempFile {
+  FILE* file = nullptr;
+
+  TempFile() {
+    const char* dir = getenv("TMPDIR");
+    if (dir == NULL || *dir == '\0') {
+      dir = "/tmp";
+    }
+    std::string path = std::string(dir) + "/choose.XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd == -1) {
+      throw std::runtime_error(std::string("failed to create a temporary file in ") + dir + ": " + strerror(errno));
+    }
+    unlink(path.c_str());
+    this->file = fdopen(fd, "w+b");
+    if (this->file == NULL) {
+      close(fd);
+      throw std::runtime_error("failed to open a temporary file");
+    }
+  }
+
+  TempFile(const TempFile&) = delete;
+  TempFile& operator=(const TempFile&) = delete;
+  TempFile(TempFile&& o) : file(o.file) { o.file = nullptr; }
+  TempFile& operator=(TempFile&& o) {
+    std::swap(this->file, o.file);
+    return *this;
+  }
+
+  ~TempFile() {
+    if (this->file) {
+      fclose(this->file);
+    }
+  }
+};
+
+namespace {
+
+struct RecordHeader {
+  uint32_t size;
+  uint32_t field_begin;
+  uint32_t field_end;
+};
+
+} // namespace
+
+// a sorted run of tokens. either written to a temporary file, or (for the last
+// run) still in memory. read back one token at a time
+template <typename T>
+struct Run {
+ private:
+  std::optional<TempFile> temp_file;
+  const std::vector<T>* memory = nullptr;
+  size_t memory_pos = 0;
+  std::vector<char> bytes; // the current token's bytes, if read from the file
+
+ public:
+  T current;
+
+  // a run which is written to a temporary file. call write then finish_writing
+  Run() : temp_file(std::in_place) {}
+
+  // a run which is already in memory. elems must outlive this
+  explicit Run(const std::vector<T>& elems) : memory(&elems) {}
+
+  void write(const T& t) {
+    FILE* f = this->temp_file->file;
+    RecordHeader header{t.size, t.field_begin, t.field_end};
+    if (fwrite(&header, sizeof(header), 1, f) != 1 //
+        || (t.size != 0 && fwrite(t.buffer_begin(), 1, t.size, f) != t.size)) {
+      throw std::runtime_error("failed to write to a temporary file");
+    }
+  }
+
+  // go back to the beginning to read
+  void finish_writing() {
+    FILE* f = this->temp_file->file;
+    if (fflush(f) != 0 || fseek(f, 0, SEEK_SET) != 0) {
+      throw std::runtime_error("failed to write to a temporary file");
+    }
+  }
+
+  // sets current to the next token. returns false if there are none left.
+  // current is only valid until the next call
+  bool next() {
+    if (this->memory) {
+      if (this->memory_pos == this->memory->size()) {
+        return false;
+      }
+      this->current = (*this->memory)[this->memory_pos++];
+      return true;
+    }
+    FILE* f = this->temp_file->file;
+    RecordHeader header; // NOLINT
+    size_t read = fread(&header, 1, sizeof(header), f);
+    if (read == 0 && feof(f)) {
+      return false;
+    }
+    if (read != sizeof(header)) {
+      throw std::runtime_error("failed to read from a temporary file");
+    }
+    this->bytes.resize(header.size);
+    if (header.size != 0 && fread(this->bytes.data(), 1, header.size, f) != header.size) {
+      throw std::runtime_error("failed to read from a temporary file");
+    }
+    this->current = T(this->bytes.data(), this->bytes.data() + header.size);
+    this->current.field_begin = header.field_begin;
+    this->current.field_end = header.field_end;
+    return true;
+  }
+};
+
+// a k-way merge of the runs, in order. each run is read from its beginning.
+// stable; ties go to the earlier run. calls sink(const T&) with each token.
+// stops early if it returns false
+template <typename T, typename Less, typename Sink>
+void merge(std::vector<Run<T>*>& runs, Less less, Sink sink) {
+  std::vector<bool> exhausted;
+  for (Run<T>* run : runs) {
+    exhausted.push_back(!run->next());
+  }
+  auto run_less = [&](size_t a, size_t b) -> bool { return less(runs[a]->current, runs[b]->current); };
+  LoserTree<decltype(run_less)> tree(runs.size(), run_less, std::move(exhausted));
+  while (!tree.empty()) {
+    Run<T>* run = runs[tree.winner()];
+    if (!sink(run->current)) {
+      return;
+    }
+    tree.replay(!run->next());
+  }
+}
+
+} // namespace spill
+
+} // namespace choose
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <poll.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <algorithm>
@@ -285,14 +286,18 @@ struct QueuedOutput {
   // selected. in this case, queue up the output, and sends it on exit.
   std::optional<std::vector<char>> queued;
 
-  void write_output(FILE* f, const std::vector<char>& v) {
+  void write_output(FILE* f, const char* begin, const char* end) {
     if (this->queued) {
-      append_to_buffer(*this->queued, v);
+      append_to_buffer(*this->queued, begin, end);
     } else {
-      write_f(f, v);
+      write_f(f, begin, end);
     }
   }
 
+  void write_output(FILE* f, const std::vector<char>& v) { //
+    write_output(f, &*v.cbegin(), &*v.cend());
+  }
+
   void flush_output(FILE* f) {
     if (this->queued) {
       write_f(f, *this->queued);
@@ -328,6 +333,13 @@ size_t get_bytes_unbuffered(int fileno, size_t n, char* out) {
   return (size_t)read_ret;
 }
 
+// true if reading from the file now would wait for more input (e.g. a pipe
+// from a slow writer). data buffered in a FILE isn't considered
+bool would_block(int fileno) {
+  struct pollfd p = {fileno, POLLIN, 0};
+  return poll(&p, 1, 0) == 0;
+}
+
 namespace utf8 {
 
 static constexpr int MAX_BYTES_PER_CHARACTER = 4;
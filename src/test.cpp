@@ -6,7 +6,11 @@
 std::optional<size_t> output_size_bound_testing;
 
 #define BOOST_TEST_MODULE choose_test_module
+#include <sys/wait.h>
 #include <boost/test/unit_test.hpp>
+#include <random>
+#include <set>
+#include <sstream>
 #include <thread>
 #include "args.hpp"
 #include "ncurses_wrapper.hpp"
@@ -22,47 +26,13 @@ make cov-show
 
 /*
 valgrind should give a clean bill of health:
-valgrind --leak-check=full --show-leak-kinds=all --track-origins=yes --verbose --log-file=valgrind-out.txt --suppressions=../path/to/valgrind_tbb.sup  ./unit_tests
+valgrind --leak-check=full --show-leak-kinds=all --track-origins=yes --verbose --log-file=valgrind-out.txt ./unit_tests
 
 if there is mis-match in the header and library version of pcre2, then this can gives errors. to make sure everything is clean,
 uninstall existing pcre2: apt-get remove libpcre2-dev,
 install pcre2 from source, preferrably >=10.42
-
-note this supression file:
 */
 
-// { # valgrind_tbb.sup
-//    tbb_malloc
-//    Memcheck:Leak
-//    match-leak-kinds: reachable
-//    fun:malloc
-//    ...
-//    obj:*/libtbb.so.*
-// }
-// {
-//    tbb_calloc
-//    Memcheck:Leak
-//    match-leak-kinds: reachable
-//    fun:calloc
-//    obj:*/libtbb.so.*
-// }
-// {
-//    tbb_dl_malloc
-//    Memcheck:Leak
-//    match-leak-kinds: reachable
-//    fun:malloc
-//    ...
-//    fun:dlopen*
-// }
-// {
-//    tbb_dl_calloc
-//    Memcheck:Leak
-//    match-leak-kinds: reachable
-//    fun:calloc
-//    ...
-//    fun:dlopen*
-// }
-
 using namespace choose;
 
 char continuation = (char)0b10000000;
@@ -262,6 +232,193 @@ BOOST_AUTO_TEST_CASE(numeric_equal_test) {
   BOOST_REQUIRE(equal_str("1", "1\xAE"));
 }
 
+BOOST_AUTO_TEST_CASE(sort_key_agrees_with_compare) {
+  std::vector<std::string> values{"",    "-",     ".",   "-.0",  ".000123", "-.000123", "123.00000000", "123.001", ".1112", ".11111111", "12.", "22", "22.001", //
+                                  "0.123", ",,.123", "1,,,,23", "012", ",,,0,,,1,,,2", "99", "111", "-99", "-111", "-9,,,,9", "-1", "-1.5", "-1.05", "1\xAE", "1e3", "abc"};
+  auto key = [](const std::string& s, Comparison type) -> std::vector<unsigned char> {
+    std::vector<unsigned char> ret;
+    if (type == numeric) {
+      sort_key::encode_numeric(&*s.cbegin(), &*s.cend(), ret);
+    } else {
+      sort_key::encode_general_numeric(&*s.cbegin(), &*s.cend(), ret);
+    }
+    return ret;
+  };
+  for (const std::string& lhs : values) {
+    for (const std::string& rhs : values) {
+      auto lhs_numeric = key(lhs, numeric);
+      auto rhs_numeric = key(rhs, numeric);
+      BOOST_REQUIRE_EQUAL(lhs_numeric < rhs_numeric, numeric_compare(&*lhs.cbegin(), &*lhs.cend(), &*rhs.cbegin(), &*rhs.cend()));
+      BOOST_REQUIRE_EQUAL(lhs_numeric == rhs_numeric, numeric_equal(&*lhs.cbegin(), &*lhs.cend(), &*rhs.cbegin(), &*rhs.cend()));
+      auto lhs_general = key(lhs, general_numeric);
+      auto rhs_general = key(rhs, general_numeric);
+      BOOST_REQUIRE_EQUAL(lhs_general < rhs_general, general_numeric_compare(&*lhs.cbegin(), &*lhs.cend(), &*rhs.cbegin(), &*rhs.cend()));
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(string_sort_matches_stable_sort) {
+  // enough elements to be split into ranges. many shared prefixes and duplicates
+  std::vector<std::string> strings;
+  srand(0);
+  for (int i = 0; i < 20000; ++i) {
+    // not stored inline, so the tokens can be told apart by where they point
+    std::string s = i % 3 ? "2024-01-01 00:00:00 host-" : "long enough to not be inline ";
+    int length = rand() % 12;
+    for (int j = 0; j < length; ++j) {
+      s.push_back("ab\xc3"[rand() % 3]);
+    }
+    strings.push_back(s);
+  }
+  for (unsigned thread_count : {1, 4}) {
+    for (bool reversed : {false, true}) {
+      std::vector<Token> tokens;
+      for (const std::string& s : strings) {
+        tokens.emplace_back(&*s.cbegin(), &*s.cend());
+      }
+      std::vector<Token> expected = tokens;
+      std::stable_sort(expected.begin(), expected.end(), [&](const Token& lhs, const Token& rhs) {
+        std::string_view l(lhs.cbegin(), lhs.cend() - lhs.cbegin());
+        std::string_view r(rhs.cbegin(), rhs.cend() - rhs.cbegin());
+        return reversed ? r < l : l < r;
+      });
+      sort_key::sort(parallel::Threads{thread_count}, tokens, lexicographical, reversed);
+      for (size_t i = 0; i < tokens.size(); ++i) {
+        BOOST_REQUIRE(tokens[i].buffer_begin() == expected[i].buffer_begin());
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(string_sort_long_keys) {
+  // each key is a run of one byte and then another. the partitions are
+  // lopsided at every depth, so this relies on the larger part being looped on
+  std::vector<std::string> strings;
+  for (int i = 0; i < 3000; ++i) {
+    strings.push_back(std::string(i, i % 2 ? 'b' : 'c') + 'a');
+  }
+  std::vector<Token> tokens;
+  for (const std::string& s : strings) {
+    tokens.emplace_back(&*s.cbegin(), &*s.cend());
+  }
+  std::vector<std::string> expected = strings;
+  std::sort(expected.begin(), expected.end());
+  sort_key::sort(parallel::Threads{}, tokens, lexicographical, false);
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    BOOST_REQUIRE(std::string(tokens[i].cbegin(), tokens[i].cend()) == expected[i]);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(presorted_runs_are_merged) {
+  std::vector<int> keys;
+  for (int i = 0; i < 2000; ++i) {
+    keys.push_back(i / 3); // ascending with duplicates
+  }
+  std::vector<std::vector<int>> patterns{keys, std::vector<int>(keys.rbegin(), keys.rend())};
+  std::vector<int> strictly_descending;
+  for (int i = 2000; i > 0; --i) {
+    strictly_descending.push_back(i);
+  }
+  patterns.push_back(strictly_descending);
+  std::vector<int> chunks = keys;
+  std::reverse(chunks.begin() + 500, chunks.begin() + 1000);
+  std::rotate(chunks.begin(), chunks.begin() + 1500, chunks.end());
+  std::swap(chunks[10], chunks[1900]);
+  patterns.push_back(chunks);
+
+  for (const std::vector<int>& pattern : patterns) {
+    std::vector<std::string> strings;
+    for (int key : pattern) {
+      char buf[32];
+      snprintf(buf, sizeof(buf), "not stored inline %06d", key);
+      strings.push_back(buf);
+    }
+    for (bool reversed : {false, true}) {
+      std::vector<Token> tokens;
+      for (const std::string& s : strings) {
+        tokens.emplace_back(&*s.cbegin(), &*s.cend());
+      }
+      std::vector<Token> expected = tokens;
+      std::stable_sort(expected.begin(), expected.end(), [&](const Token& lhs, const Token& rhs) {
+        return reversed ? lexicographical_comparison(rhs, lhs) : lexicographical_comparison(lhs, rhs);
+      });
+      sort_key::sort(parallel::Threads{}, tokens, lexicographical, reversed);
+      for (size_t i = 0; i < tokens.size(); ++i) {
+        BOOST_REQUIRE(tokens[i].buffer_begin() == expected[i].buffer_begin());
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(stable_partial_sort_matches_stable_sort) {
+  std::vector<std::pair<int, int>> values;
+  srand(0);
+  for (int i = 0; i < 1000; ++i) {
+    values.push_back({rand() % 50, i});
+  }
+  auto comp = [](const std::pair<int, int>& lhs, const std::pair<int, int>& rhs) { return lhs.first < rhs.first; };
+  std::vector<std::pair<int, int>> expected = values;
+  std::stable_sort(expected.begin(), expected.end(), comp);
+  for (unsigned thread_count : {1, 4}) {
+    for (size_t n : {0, 1, 100, 999, 1000}) {
+      std::vector<std::pair<int, int>> v = values;
+      stable_partial_sort(parallel::Threads{thread_count}, v.begin(), v.begin() + n, v.end(), comp);
+      BOOST_REQUIRE(std::equal(v.begin(), v.begin() + n, expected.begin()));
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(parallel_sort_is_stable) {
+  std::vector<std::pair<int, int>> values;
+  srand(0);
+  for (int i = 0; i < 100000; ++i) {
+    values.push_back({rand() % 1000, i});
+  }
+  auto comp = [](const std::pair<int, int>& lhs, const std::pair<int, int>& rhs) { return lhs.first < rhs.first; };
+  std::vector<std::pair<int, int>> expected = values;
+  std::stable_sort(expected.begin(), expected.end(), comp);
+  for (unsigned thread_count : {2, 3, 4, 7}) {
+    std::vector<std::pair<int, int>> v = values;
+    parallel::sort(parallel::Threads{thread_count, true}, v.begin(), v.end(), comp);
+    BOOST_REQUIRE(v == expected);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(background_sorted_runs_merge) {
+  std::vector<std::pair<int, int>> values;
+  srand(0);
+  for (int i = 0; i < 10000; ++i) {
+    values.push_back({rand() % 100, i});
+  }
+  auto comp = [](const std::pair<int, int>& lhs, const std::pair<int, int>& rhs) { return lhs.first < rhs.first; };
+  std::vector<std::pair<int, int>> expected = values;
+  std::stable_sort(expected.begin(), expected.end(), comp);
+  for (unsigned thread_count : {1, 3}) {
+    std::vector<std::pair<int, int>> v = values;
+    std::vector<size_t> bounds{0, 1, 1000, 1001, 5000, 9999, 10000}; // uneven and empty-ish runs
+    {
+      parallel::Background background(parallel::Threads{thread_count});
+      for (size_t i = 0; i + 1 < bounds.size(); ++i) {
+        background.submit([&, i] { std::stable_sort(v.begin() + bounds[i], v.begin() + bounds[i + 1], comp); });
+      }
+      background.wait();
+    }
+    parallel::merge_runs(parallel::Threads{thread_count}, v.data(), bounds, comp);
+    BOOST_REQUIRE(v == expected);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(background_error_is_rethrown_once) {
+  parallel::Background background(parallel::Threads{3});
+  background.submit([] { throw std::runtime_error("task failed"); });
+  BOOST_REQUIRE_THROW(background.wait(), std::runtime_error);
+  // later work on the same pool isn't affected
+  std::atomic<size_t> sum{0};
+  background.run(100, [&](size_t i) { sum += i; });
+  BOOST_REQUIRE_EQUAL(sum, 4950);
+  background.wait();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
 BOOST_AUTO_TEST_SUITE(other_string_utils_test_suite)
@@ -357,6 +514,146 @@ BOOST_AUTO_TEST_CASE(apply_index_op_after) {
 
 BOOST_AUTO_TEST_SUITE_END()
 
+BOOST_AUTO_TEST_SUITE(flat_hash_set_test_suite)
+
+BOOST_AUTO_TEST_CASE(insert_find_erase) {
+  FlatHashSet<size_t> set;
+  std::vector<uint64_t> hashes;
+  for (size_t i = 0; i < 1000; ++i) {
+    hashes.push_back(hash::mix64(i));
+  }
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    auto eq = [&](size_t v) { return v == i; };
+    auto [slot, found] = set.find_or_prepare_insert(hashes[i], eq);
+    BOOST_REQUIRE(!found);
+    set.insert_at(slot, hashes[i], i);
+  }
+  BOOST_REQUIRE_EQUAL(set.size(), 1000);
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    size_t slot = set.find(hashes[i], [&](size_t v) { return v == i; });
+    BOOST_REQUIRE(slot != set.capacity());
+    BOOST_REQUIRE_EQUAL(set.slot(slot).value, i);
+  }
+  // erase the evens
+  for (size_t i = 0; i < hashes.size(); i += 2) {
+    set.erase_at(set.find(hashes[i], [&](size_t v) { return v == i; }));
+  }
+  BOOST_REQUIRE_EQUAL(set.size(), 500);
+  for (size_t i = 0; i < hashes.size(); ++i) {
+    bool exists = set.find(hashes[i], [&](size_t v) { return v == i; }) != set.capacity();
+    BOOST_REQUIRE_EQUAL(exists, i % 2 == 1);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(colliding_hashes) {
+  // every element has the same hash. only the equality check tells them apart
+  FlatHashSet<size_t> set;
+  set.max_load_factor(1); // clamped
+  for (size_t i = 0; i < 100; ++i) {
+    auto [slot, found] = set.find_or_prepare_insert(123, [&](size_t v) { return v == i; });
+    BOOST_REQUIRE(!found);
+    set.insert_at(slot, 123, i);
+  }
+  auto [slot, found] = set.find_or_prepare_insert(123, [&](size_t v) { return v == 50; });
+  BOOST_REQUIRE(found);
+  BOOST_REQUIRE_EQUAL(set.slot(slot).value, 50);
+  BOOST_REQUIRE(set.capacity() > set.size());
+}
+
+BOOST_AUTO_TEST_CASE(btree_set_matches_std_set) {
+  // enough elements for a few levels, with erases causing borrows and merges
+  auto less = [](size_t lhs, size_t rhs) { return lhs < rhs; };
+  BTreeSet<size_t, decltype(less)> set(less);
+  std::set<size_t> correct;
+  for (size_t i = 0; i < 20000; ++i) {
+    size_t v = hash::mix64(i) % 5000;
+    if (i % 3 == 2) {
+      BOOST_REQUIRE_EQUAL(set.erase(v), correct.erase(v) == 1);
+    } else {
+      auto [position, found] = set.find_or_prepare_insert(v);
+      BOOST_REQUIRE_EQUAL(found, correct.count(v) == 1);
+      if (!found) {
+        set.insert_at(position, v);
+        correct.insert(v);
+      }
+    }
+    BOOST_REQUIRE_EQUAL(set.size(), correct.size());
+  }
+  std::vector<size_t> walked;
+  set.for_each([&](size_t v) { walked.push_back(v); });
+  BOOST_REQUIRE(walked == std::vector<size_t>(correct.begin(), correct.end()));
+  for (size_t v : walked) {
+    BOOST_REQUIRE(set.erase(v));
+  }
+  BOOST_REQUIRE_EQUAL(set.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(hash_bytes) {
+  // every length path gives equal hashes for equal content at different addresses
+  std::vector<char> a;
+  std::vector<char> b;
+  for (size_t len = 0; len < 200; ++len) {
+    a.resize(len, 'x');
+    b.resize(len + 1, 'x');
+    BOOST_REQUIRE_EQUAL(hash::bytes(a.data(), len, 1), hash::bytes(b.data() + 1, len, 1));
+    if (len) {
+      BOOST_REQUIRE(hash::bytes(a.data(), len, 1) != hash::bytes(a.data(), len - 1, 1));
+      BOOST_REQUIRE(hash::bytes(a.data(), len, 1) != hash::bytes(a.data(), len, 2));
+    }
+  }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(token_storage_test_suite)
+
+BOOST_AUTO_TEST_CASE(arena_store) {
+  Arena arena;
+  const char* a = "hello";
+  const char* b = "world";
+  const char* a_stored = arena.store(a, a + 5);
+  const char* b_stored = arena.store(b, b + 5);
+  BOOST_REQUIRE(std::string_view(a_stored, 5) == "hello");
+  BOOST_REQUIRE(std::string_view(b_stored, 5) == "world");
+  BOOST_REQUIRE_EQUAL(arena.bytes_used, 10);
+  BOOST_REQUIRE_EQUAL(arena.chunks.size(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(arena_oversized) {
+  Arena arena;
+  std::vector<char> big(Arena::INITIAL_CHUNK_SIZE * 3, 'x');
+  arena.store(big.data(), big.data() + 1);
+  const char* large = arena.store(&*big.cbegin(), &*big.cend());
+  BOOST_REQUIRE_EQUAL(arena.chunks.size(), 2);
+  BOOST_REQUIRE(std::equal(large, large + big.size(), big.cbegin(), big.cend()));
+  BOOST_REQUIRE_EQUAL(arena.bytes_used, big.size() + 1);
+}
+
+BOOST_AUTO_TEST_CASE(token_inline_and_arena) {
+  Arena arena;
+  const char* short_str = "short";
+  const char* long_str = "this token is longer than the inline capacity";
+  Token short_token(short_str, short_str + strlen(short_str));
+  Token long_token(long_str, long_str + strlen(long_str));
+  BOOST_REQUIRE(short_token.is_inline());
+  BOOST_REQUIRE(!long_token.is_inline());
+  BOOST_REQUIRE(long_token.buffer_begin() == long_str); // refers to the range until stored
+  short_token.store_in(arena);
+  long_token.store_in(arena);
+  BOOST_REQUIRE_EQUAL(arena.bytes_used, strlen(long_str));
+  BOOST_REQUIRE(std::string_view(short_token.buffer_begin(), short_token.size) == short_str);
+  BOOST_REQUIRE(std::string_view(long_token.buffer_begin(), long_token.size) == long_str);
+  BOOST_REQUIRE(long_token.buffer_begin() != long_str);
+
+  // field offsets survive a copy of the inline bytes
+  short_token.field_begin = 1;
+  short_token.field_end = 3;
+  Token copy = short_token;
+  BOOST_REQUIRE(std::string_view(copy.cbegin(), copy.cend() - copy.cbegin()) == "ho");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
 // choose either sends to stdout, or creates an interface that displays tokens
 struct choose_output {
   std::variant<std::vector<char>, choose::CreateTokensResult> o;
@@ -376,12 +673,14 @@ struct choose_output {
         return false;
       }
       if (first.initial_selected_token.has_value()) {
-        if (first.initial_selected_token->buffer != second.initial_selected_token->buffer) {
+        const Token& first_selected = *first.initial_selected_token;
+        const Token& second_selected = *second.initial_selected_token;
+        if (!std::equal(first_selected.buffer_begin(), first_selected.buffer_end(), second_selected.buffer_begin(), second_selected.buffer_end())) {
           return false;
         }
       }
       return std::equal(first.tokens.begin(), first.tokens.end(), second.tokens.begin(), second.tokens.end(), [](const choose::Token& lhs, const choose::Token& rhs) -> bool { //
-        return lhs.buffer == rhs.buffer;
+        return std::equal(lhs.buffer_begin(), lhs.buffer_end(), rhs.buffer_begin(), rhs.buffer_end());
       });
     }
   }
@@ -411,7 +710,7 @@ std::ostream& operator<<(std::ostream& os, const choose_output& out) {
     if (out_tokens.initial_selected_token.has_value()) {
       os << "(cursor:";
       bool first = true;
-      for (char ch : out_tokens.initial_selected_token->buffer) {
+      for (char ch : std::string_view(out_tokens.initial_selected_token->buffer_begin(), out_tokens.initial_selected_token->size)) {
         if (!first) {
           os << ',';
         }
@@ -434,7 +733,7 @@ std::ostream& operator<<(std::ostream& os, const choose_output& out) {
       }
       first_token = false;
       bool first_in_token = true;
-      for (char ch : t.buffer) {
+      for (char ch : std::string_view(t.buffer_begin(), t.size)) {
         if (!first_in_token) {
           os << ',';
         }
@@ -646,6 +945,19 @@ BOOST_AUTO_TEST_CASE(general_numeric_unique_with_parse_failure) {
   BOOST_REQUIRE_EQUAL(out, correct_output);
 }
 
+BOOST_AUTO_TEST_CASE(general_numeric_unique_precision) {
+  // distinct beyond float precision. values in [0,1) must not all collide either
+  choose_output out = run_choose("1700000000123\n1700000000124\n1700000000123\n0.25\n0.5\n.25\n-0\n0\nnan\nnan", {"--unique-general-numeric"});
+  choose_output correct_output{to_vec("1700000000123\n1700000000124\n0.25\n0.5\n-0\nnan\n")};
+  BOOST_REQUIRE_EQUAL(out, correct_output);
+}
+
+BOOST_AUTO_TEST_CASE(general_numeric_unique_precision_use_set) {
+  choose_output out = run_choose("1700000000123\n1700000000124\n1700000000123\n0.25\n0.5\n.25\n-0\n0\nnan\nnan", {"--unique-general-numeric", "--unique-use-set"});
+  choose_output correct_output{to_vec("1700000000123\n1700000000124\n0.25\n0.5\n-0\nnan\n")};
+  BOOST_REQUIRE_EQUAL(out, correct_output);
+}
+
 BOOST_AUTO_TEST_CASE(numeric_unique_use_set) {
   choose_output out = run_choose("-0\n0\n.0\n1\n1.0\n0001.0", {"--unique-numeric", "--unique-use-set"});
   choose_output correct_output{to_vec("-0\n1\n")};
@@ -658,6 +970,30 @@ BOOST_AUTO_TEST_CASE(general_numeric_unique_use_set) {
   BOOST_REQUIRE_EQUAL(out, correct_output);
 }
 
+BOOST_AUTO_TEST_CASE(unique_use_set_sorted_from_tree) {
+  choose_output out = run_choose("b\nc\na\nb\nd\na", {"--unique-use-set", "-s"});
+  choose_output correct_output{to_vec("a\nb\nc\nd\n")};
+  BOOST_REQUIRE_EQUAL(out, correct_output);
+  out = run_choose("1\n10\n1e1\n2\n1e0", {"--unique-general-numeric", "--unique-use-set", "--sort-general-numeric", "--sort-reverse"});
+  correct_output = choose_output{to_vec("10\n2\n1\n")};
+  BOOST_REQUIRE_EQUAL(out, correct_output);
+}
+
+BOOST_AUTO_TEST_CASE(bounded_sort_unique_eviction) {
+  // evicted tokens are removed from the uniqueness set
+  for (const char* use_set : {"--unique-use-set", "--unique"}) {
+    choose_output out = run_choose("d\nc\nb\na\nb\na\nc\nd\na", {"-u", "-s", "--out", "2", use_set});
+    choose_output correct_output{to_vec("a\nb\n")};
+    BOOST_REQUIRE_EQUAL(out, correct_output);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(bounded_sort_keeps_first_of_equal) {
+  choose_output out = run_choose("2\n1.0\n3\n1\n01\n0\n1.00", {"-sn", "--out", "3"});
+  choose_output correct_output{to_vec("0\n1.0\n1\n")};
+  BOOST_REQUIRE_EQUAL(out, correct_output);
+}
+
 BOOST_AUTO_TEST_CASE(partial_stable_sort_full_coverage) {
   choose_output out = run_choose("d\na\nb\nc", {"--stable", "--sort-reverse", "--out", "3", "--truncate-no-bound"});
   choose_output correct_output{to_vec("d\nc\nb\n")};
@@ -676,6 +1012,37 @@ BOOST_AUTO_TEST_CASE(general_numeric_sort) {
   BOOST_REQUIRE_EQUAL(out, correct_output);
 }
 
+BOOST_AUTO_TEST_CASE(sort_shared_prefixes) {
+  // differences before, at and after the 8 byte prefix
+  choose_output out = run_choose("2024-01-01 b\n2024-01-01 a\n2024-01-0\n2024-01-01\n2024-01-01 a\n\n2024-01-01\xc3\xa9\n2024-01-01z", {"--sort", "--stable"});
+  choose_output correct_output{to_vec("\n2024-01-0\n2024-01-01\n2024-01-01 a\n2024-01-01 a\n2024-01-01 b\n2024-01-01z\n2024-01-01\xc3\xa9\n")};
+  BOOST_REQUIRE_EQUAL(out, correct_output);
+}
+
+BOOST_AUTO_TEST_CASE(sort_unsigned_bytes_bounded) {
+  // same order as the full sort, when bounded
+  choose_output out = run_choose("\xc3\xa9\nz\na", {"--sort", "--out", "2"});
+  choose_output correct_output{to_vec("a\nz\n")};
+  BOOST_REQUIRE_EQUAL(out, correct_output);
+}
+
+BOOST_AUTO_TEST_CASE(general_numeric_sort_special_values) {
+  // parse failures, then nan, then numbers. out of range values saturate
+  choose_output out = run_choose("1e999\n-1e999\nnan\n1e-999\n-inf\nx\n0.1\n-1e-999\n1e308", {"--sort-general-numeric", "--stable"});
+  choose_output correct_output{to_vec("x\nnan\n-1e999\n-inf\n1e-999\n-1e-999\n0.1\n1e308\n1e999\n")};
+  BOOST_REQUIRE_EQUAL(out, correct_output);
+}
+
+BOOST_AUTO_TEST_CASE(numeric_sort_radix_with_fallback) {
+  // plain numbers are radix sorted, and the rest are merged in
+  choose_output out = run_choose("10\n-2.5\nabc\n3,000\n-2.50\n1e3\n0.1\n\n10.0\n99999999999999999999\n0.000000000000000000001", {"--sort-numeric"});
+  choose_output correct_output{to_vec("-2.5\n-2.50\n\n0.000000000000000000001\n0.1\n10\n10.0\n1e3\nabc\n3,000\n99999999999999999999\n")};
+  BOOST_REQUIRE_EQUAL(out, correct_output);
+  out = run_choose("10\n-2.5\nabc\n3,000\n-2.50\n1e3\n0.1\n\n10.0", {"--sort-numeric", "--sort-reverse"});
+  correct_output = choose_output{to_vec("3,000\nabc\n1e3\n10\n10.0\n0.1\n\n-2.5\n-2.50\n")};
+  BOOST_REQUIRE_EQUAL(out, correct_output);
+}
+
 BOOST_AUTO_TEST_CASE(numeric_sort_2) {
   choose_output out = run_choose("3\n-2.1\n-2\n-1\n2\n1\n3", {"--sort-numeric"});
   choose_output correct_output{to_vec("-2.1\n-2\n-1\n1\n2\n3\n3\n")};
@@ -748,6 +1115,13 @@ BOOST_AUTO_TEST_CASE(tail) {
   BOOST_REQUIRE_EQUAL(out, correct_output);
 }
 
+BOOST_AUTO_TEST_CASE(tail_wraps_around) {
+  OutputSizeBoundFixture f(3);
+  choose_output out = run_choose("1\n2\n3\n4\n5\n6\n7\n8\n9\n10", {"--tail=3"});
+  choose_output correct_output{to_vec("8\n9\n10\n")};
+  BOOST_REQUIRE_EQUAL(out, correct_output);
+}
+
 BOOST_AUTO_TEST_CASE(tail_min) {
   OutputSizeBoundFixture f(4);
   choose_output out = run_choose("blah\nhere\nthis\nis\na\ntest", {"--tail=1,4"});
@@ -761,6 +1135,284 @@ BOOST_AUTO_TEST_CASE(sort_unique) {
   BOOST_REQUIRE_EQUAL(out, correct_output);
 }
 
+BOOST_AUTO_TEST_CASE(sharded_unique_matches_sequential) {
+  // more than one batch, within what fits in the pipe
+  std::string input;
+  srand(0);
+  for (int i = 0; i < 30000; ++i) {
+    input += (char)('0' + rand() % 60);
+    input += '\n';
+  }
+  std::vector<std::vector<const char*>> arg_sets = {{"-u"}, {"-u", "-s"}, {"--unique-numeric", "--sort-reverse"}, {"--unique-general-numeric", "--flip"}};
+  for (const std::vector<const char*>& args : arg_sets) {
+    std::vector<const char*> sequential_args = args;
+    sequential_args.push_back("--threads=1");
+    std::vector<const char*> sharded_args = args;
+    sharded_args.push_back("--threads=4");
+    BOOST_REQUIRE_EQUAL(run_choose(input.c_str(), sharded_args), run_choose(input.c_str(), sequential_args));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(count) {
+  for (const char* variant : {"--threads=1", "--threads=4", "--unique-use-set"}) {
+    choose_output out = run_choose("b\na\nb\nc\nb\na", {"--count", variant});
+    BOOST_REQUIRE_EQUAL(out, choose_output{to_vec("      3 b\n      2 a\n      1 c\n")});
+  }
+  choose_output out = run_choose("b\na\nb\nc\nb\na", {"--count", "-s"});
+  BOOST_REQUIRE_EQUAL(out, choose_output{to_vec("      2 a\n      3 b\n      1 c\n")});
+  out = run_choose("x 1\ny 1.0\nz 2\nw 01", {"--count", "--unique-numeric", "--field", "\\d.*"});
+  BOOST_REQUIRE_EQUAL(out, choose_output{to_vec("      3 x 1\n      1 z 2\n")});
+}
+
+BOOST_AUTO_TEST_CASE(top_frequent) {
+  OutputSizeBoundFixture f(0); // only made at the end
+  // enough room, so the counts are exact. ties go to the first seen
+  choose_output out = run_choose("b\na\nb\nc\nb\na\nc", {"--top-frequent=3"});
+  BOOST_REQUIRE_EQUAL(out, choose_output{to_vec("      3 b\n      2 a\n      2 c\n")});
+  out = run_choose("b\na\nb\nc\nb\na", {"--top-frequent=2"});
+  BOOST_REQUIRE_EQUAL(out, choose_output{to_vec("      3 b\n      2 a\n")});
+  // c replaces a, then a replaces c. a's count is too high
+  out = run_choose("b\na\nb\nc\nb\na", {"--top-frequent=2", "--top-frequent-capacity=2"});
+  BOOST_REQUIRE_EQUAL(out, choose_output{to_vec("      3 b\n      3 a\n")});
+  out = run_choose("1\n1.0\n2\n3\n2.00\n1", {"--top-frequent=10", "--unique-general-numeric", "--out=1"});
+  BOOST_REQUIRE_EQUAL(out, choose_output{to_vec("      3 1\n")});
+}
+
+BOOST_AUTO_TEST_CASE(top_frequent_skewed) {
+  // token i appears 1000 / (i + 1) times, shuffled. more distinct tokens than
+  // the capacity, so the counts are approximate but the ranking still holds
+  std::vector<std::string> tokens;
+  for (int i = 0; i < 1000; ++i) {
+    for (int j = 0; j < 1000 / (i + 1); ++j) {
+      tokens.push_back("tok" + std::to_string(i));
+    }
+  }
+  size_t total = tokens.size();
+  std::mt19937 rng(1);
+  std::shuffle(tokens.begin(), tokens.end(), rng);
+  std::string input;
+  for (const std::string& t : tokens) {
+    input += t + "\n";
+  }
+
+  OutputSizeBoundFixture f(0);
+  choose_output out = run_choose(input.c_str(), {"--top-frequent=5", "--top-frequent-capacity=300"});
+  std::string written(std::get<std::vector<char>>(out.o).begin(), std::get<std::vector<char>>(out.o).end());
+  std::istringstream lines(written);
+  size_t prev_count = std::numeric_limits<size_t>::max();
+  for (int i = 0; i < 5; ++i) {
+    size_t count; // NOLINT
+    std::string name;
+    BOOST_REQUIRE(lines >> count >> name);
+    BOOST_REQUIRE_EQUAL(name, "tok" + std::to_string(i));
+    size_t exact = 1000 / (i + 1);
+    BOOST_REQUIRE(count >= exact && count <= exact + total / 300);
+    BOOST_REQUIRE(count <= prev_count);
+    prev_count = count;
+  }
+  BOOST_REQUIRE(!(lines >> prev_count));
+
+  // with the default capacity, which is more than the distinct tokens, the counts are exact
+  out = run_choose(input.c_str(), {"--top-frequent=3"});
+  BOOST_REQUIRE_EQUAL(out, choose_output{to_vec("   1000 tok0\n    500 tok1\n    333 tok2\n")});
+}
+
+BOOST_AUTO_TEST_CASE(unique_window) {
+  OutputSizeBoundFixture f(0);
+  // a seen again is the most recent, so b is forgotten first
+  choose_output out = run_choose("a\nb\na\nc\nd\na\nb\nb", {"--unique-window=2"});
+  choose_output correct_output{to_vec("a\nb\nc\nd\na\nb\n")};
+  BOOST_REQUIRE_EQUAL(out, correct_output);
+  out = run_choose("1\n1.0\n2\n3\n1.00", {"--unique-numeric", "--unique-window=2", "--out=3"});
+  correct_output = choose_output{to_vec("1\n2\n3\n")};
+  BOOST_REQUIRE_EQUAL(out, correct_output);
+  // long tokens aren't inline
+  out = run_choose("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\nb\naaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", {"--unique-ttl=1h"});
+  correct_output = choose_output{to_vec("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\nb\n")};
+  BOOST_REQUIRE_EQUAL(out, correct_output);
+}
+
+BOOST_AUTO_TEST_CASE(unique_hashed) {
+  std::string input;
+  srand(0);
+  for (int i = 0; i < 500; ++i) {
+    input += std::to_string(rand() % 200) + (rand() % 2 ? ".0" : "") + "\n";
+  }
+  for (const char* type : {"--unique", "--unique-general-numeric"}) {
+    choose_output correct_output = run_choose(input.c_str(), {type});
+    OutputSizeBoundFixture f(0);
+    BOOST_REQUIRE_EQUAL(run_choose(input.c_str(), {type, "--unique-hashed"}), correct_output);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(bounded_unique_different_sort) {
+  // lexicographical uniqueness with another sort, and uniqueness without a
+  // sort, are bounded. the same as if everything was stored
+  std::string input;
+  srand(0);
+  for (int i = 0; i < 500; ++i) {
+    input += std::to_string(rand() % 100) + (rand() % 2 ? ".0" : "") + "\n";
+  }
+  std::vector<std::vector<const char*>> arg_sets = {{"-u", "-sn", "--out=5"}, {"-u", "--sort-general-numeric", "--sort-reverse", "--out=2,5"}, {"-u", "-sn", "--tail=5"}, {"-u", "--out=5"}, {"-u", "--out=5", "--flip"}};
+  for (const std::vector<const char*>& args : arg_sets) {
+    std::vector<const char*> unbounded_args = args;
+    unbounded_args.push_back("--truncate-no-bound");
+    choose_output correct_output = run_choose(input.c_str(), unbounded_args);
+    OutputSizeBoundFixture f(5);
+    BOOST_REQUIRE_EQUAL(run_choose(input.c_str(), args), correct_output);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(max_memory_spill) {
+  std::string input;
+  srand(0);
+  for (int i = 0; i < 500; ++i) {
+    input += std::to_string(rand() % 300) + (rand() % 2 ? ".0" : "") + "\n";
+  }
+  std::vector<std::vector<const char*>> arg_sets = {{"-s"}, {"-s", "-u"}, {"-sn", "--unique-numeric"}, {"-sn", "-u"}, {"--sort-reverse", "-u", "--out=10,50", "--truncate-no-bound"}};
+  for (const std::vector<const char*>& args : arg_sets) {
+    choose_output correct_output = run_choose(input.c_str(), args);
+    std::vector<const char*> spill_args = args;
+    spill_args.push_back("--max-memory=1"); // a run for each token, and then some merged together
+    OutputSizeBoundFixture f(1);
+    BOOST_REQUIRE_EQUAL(run_choose(input.c_str(), spill_args), correct_output);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(merge_sorted_inputs) {
+  std::vector<std::string> paths;
+  for (const char* content : {"1\n3\n3\n10\n", "", "2\n3.0\n4\n"}) {
+    char path[] = "/tmp/choose_test.XXXXXX";
+    int fd = mkstemp(path);
+    BOOST_REQUIRE(fd != -1);
+    BOOST_REQUIRE(write(fd, content, strlen(content)) == (ssize_t)strlen(content));
+    close(fd);
+    paths.push_back(path);
+  }
+  // stdin is only read if - is given
+  std::vector<const char*> args{"-n", "--merge", paths[0].c_str(), "--merge", paths[1].c_str(), "--merge", "-", "--merge", paths[2].c_str()};
+  choose_output out = run_choose("0\n3\n", args);
+  BOOST_REQUIRE_EQUAL(out, choose_output{to_vec("0\n1\n2\n3\n3\n3\n3.0\n4\n10\n")});
+  args.push_back("--unique-numeric");
+  out = run_choose("0\n3\n", args);
+  BOOST_REQUIRE_EQUAL(out, choose_output{to_vec("0\n1\n2\n3\n4\n10\n")});
+  args.push_back("--out=2");
+  out = run_choose("0\n3\n", args);
+  BOOST_REQUIRE_EQUAL(out, choose_output{to_vec("0\n1\n")});
+  // lexicographical uniqueness, with duplicates that aren't adjacent
+  args = {"--sort-numeric", "-u", "--merge", paths[0].c_str(), "--merge", "-", "--merge", paths[2].c_str()};
+  out = run_choose("0\n3\n03\n3\n", args);
+  BOOST_REQUIRE_EQUAL(out, choose_output{to_vec("0\n1\n2\n3\n03\n3.0\n4\n10\n")});
+  for (const std::string& path : paths) {
+    unlink(path.c_str());
+  }
+}
+
+BOOST_AUTO_TEST_CASE(unique_state_across_runs) {
+  char path[] = "/tmp/choose_test.XXXXXX";
+  int fd = mkstemp(path);
+  BOOST_REQUIRE(fd != -1);
+  close(fd); // empty, so it's created
+  OutputSizeBoundFixture f(0);
+  choose_output out = run_choose("a\nb\na", {"--unique-state", path});
+  BOOST_REQUIRE_EQUAL(out, choose_output{to_vec("a\nb\n")});
+  out = run_choose("b\nc\na\nd\nc", {"--unique-state", path});
+  BOOST_REQUIRE_EQUAL(out, choose_output{to_vec("c\nd\n")});
+  // enough runs that the table grows, and everything from before is still there
+  for (int run = 0; run < 5; ++run) {
+    std::string input;
+    for (int i = 0; i < 10000; ++i) {
+      input += std::to_string(run * 10000 + i) + "\n";
+    }
+    BOOST_REQUIRE_EQUAL(run_choose(input.c_str(), {"--unique-state", path}), choose_output{to_vec(input.c_str())});
+  }
+  out = run_choose("0\n12345\n49999\n50000\nd", {"--unique-state", path});
+  BOOST_REQUIRE_EQUAL(out, choose_output{to_vec("50000\n")});
+  unlink(path);
+}
+
+BOOST_AUTO_TEST_CASE(unique_state_different_type) {
+  char path[] = "/tmp/choose_test.XXXXXX";
+  int fd = mkstemp(path);
+  BOOST_REQUIRE(fd != -1);
+  close(fd);
+  run_choose("1", {"--unique-state", path});
+  std::vector<std::pair<std::vector<const char*>, const char*>> cases{
+      {{"--unique-general-numeric", "--unique-state", path}, "was made with a different type of uniqueness"},
+      {{"--field", "^[^ ]*", "--unique-state", path}, "was made with a different --field or --index"},
+  };
+  for (const auto& [args, message] : cases) {
+    // reported like other arg errors, from a child since it exits
+    int err_pipe[2];
+    BOOST_REQUIRE(pipe(err_pipe) == 0);
+    pid_t pid = fork();
+    BOOST_REQUIRE(pid != -1);
+    if (pid == 0) {
+      dup2(err_pipe[1], STDERR_FILENO);
+      run_choose("1", args);
+      _exit(EXIT_SUCCESS);
+    }
+    close(err_pipe[1]);
+    std::string err;
+    char buf[256];
+    ssize_t len; // NOLINT
+    while ((len = read(err_pipe[0], buf, sizeof(buf))) > 0) {
+      err.append(buf, len);
+    }
+    close(err_pipe[0]);
+    int status; // NOLINT
+    BOOST_REQUIRE(waitpid(pid, &status, 0) == pid);
+    BOOST_REQUIRE(WIFEXITED(status));
+    BOOST_REQUIRE_EQUAL(WEXITSTATUS(status), EXIT_FAILURE);
+    BOOST_REQUIRE(err.find(message) != std::string::npos);
+  }
+  unlink(path);
+}
+
+BOOST_AUTO_TEST_CASE(unique_state_concurrent) {
+  char path[] = "/tmp/choose_test.XXXXXX";
+  int fd = mkstemp(path);
+  BOOST_REQUIRE(fd != -1);
+  close(fd);
+  uint64_t inserted = 100000; // enough that the table grows, replacing the file
+  bool second_saw_first = false;
+  std::thread t;
+  {
+    UniqueState first(path, 0, 0);
+    // blocks on the lock, on the file which is then replaced
+    t = std::thread([&] {
+      UniqueState second(path, 0, 0);
+      second_saw_first = !second.insert(1, 1);
+      second.insert(inserted + 1, 0);
+      second.commit();
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    for (uint64_t i = 1; i <= inserted; ++i) {
+      first.insert(i, i);
+    }
+    first.commit();
+  }
+  t.join();
+  UniqueState third(path, 0, 0);
+  BOOST_REQUIRE(second_saw_first);
+  BOOST_REQUIRE(!third.insert(inserted, inserted));
+  BOOST_REQUIRE(!third.insert(inserted + 1, 0));
+  unlink(path);
+}
+
+BOOST_AUTO_TEST_CASE(assume_sorted_unique) {
+  OutputSizeBoundFixture f(0); // nothing is stored
+  choose_output out = run_choose("a\na\nb\nb\na", {"-u", "--assume-sorted"});
+  BOOST_REQUIRE_EQUAL(out, choose_output{to_vec("a\nb\na\n")});
+  out = run_choose("3\n3.0\n2\n1\n1", {"--unique-numeric", "--assume-sorted"});
+  BOOST_REQUIRE_EQUAL(out, choose_output{to_vec("3\n2\n1\n")});
+}
+
+BOOST_AUTO_TEST_CASE(assume_sorted_unique_then_sort) {
+  choose_output out = run_choose("b\nb\na\na\nb", {"-u", "--assume-sorted", "-s"});
+  BOOST_REQUIRE_EQUAL(out, choose_output{to_vec("a\nb\nb\n")});
+}
+
 BOOST_AUTO_TEST_CASE(truncate_no_bound_sort) {
   // difficult to see different from this option, other than from the benchmarks
   choose_output out = run_choose("this\nis\na\ntest", {"--sort", "--out=2", "--truncate-no-bound"});
@@ -909,7 +1561,16 @@ BOOST_AUTO_TEST_CASE(unique_with_set) {
   BOOST_REQUIRE_EQUAL(out, correct_output);
 }
 
-#ifndef CHOOSE_DISABLE_FIELD
+BOOST_AUTO_TEST_CASE(unique_long_tokens_from_scratch) {
+  // tokens longer than the inline capacity, which are checked for uniqueness while in the op scratch buffer
+  const char* input = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\nbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb\nxaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\nbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb";
+  choose_output out = run_choose(input, {"-u", "-r", "--sub", "^x", "a", "-t"});
+  choose_output correct_output{CreateTokensResult{std::vector<choose::Token>{"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbb"}}};
+  BOOST_REQUIRE_EQUAL(out, correct_output);
+  out = run_choose(input, {"-u", "--unique-use-set", "-r", "--sub", "^x", "a", "-t"});
+  BOOST_REQUIRE_EQUAL(out, correct_output);
+}
+
 BOOST_AUTO_TEST_CASE(unique_by_field) {
   choose_output out = run_choose("alpha,tester\nbeta,tester\ngamma,tester,abcde", {"-t", "--unique", "--field", "^[^,]*+.\\K[^,]*+"});
   choose_output correct_output{CreateTokensResult{std::vector<choose::Token>{"alpha,tester"}}};
@@ -927,7 +1588,6 @@ BOOST_AUTO_TEST_CASE(field_with_no_matches) {
   choose_output correct_output{CreateTokensResult{std::vector<choose::Token>{"no match!", "zzz 123", "abc 1245"}}};
   BOOST_REQUIRE_EQUAL(out, correct_output);
 }
-#endif
 
 // ========================
 
@@ -1494,6 +2154,22 @@ BOOST_AUTO_TEST_CASE(parse_number_pair) {
   BOOST_REQUIRE_EQUAL(err_count, 3);
 }
 
+BOOST_AUTO_TEST_CASE(parse_duration) {
+  auto should_not_be_called = []() { BOOST_REQUIRE(false); };
+  BOOST_REQUIRE_EQUAL(num::parse_duration_ms(should_not_be_called, "15"), 15000);
+  BOOST_REQUIRE_EQUAL(num::parse_duration_ms(should_not_be_called, "250ms"), 250);
+  BOOST_REQUIRE_EQUAL(num::parse_duration_ms(should_not_be_called, "2m"), 120000);
+  BOOST_REQUIRE_EQUAL(num::parse_duration_ms(should_not_be_called, "1h"), 3600000);
+
+  int err_count = 0;
+  auto must_be_called = [&]() { ++err_count; };
+  BOOST_REQUIRE_EQUAL(num::parse_duration_ms(must_be_called, "s"), 0);
+  BOOST_REQUIRE_EQUAL(num::parse_duration_ms(must_be_called, "0s"), 0);
+  BOOST_REQUIRE_EQUAL(num::parse_duration_ms(must_be_called, "5d"), 0);
+  BOOST_REQUIRE_EQUAL(num::parse_duration_ms(must_be_called, "99999999999999999h"), 0);
+  BOOST_REQUIRE_EQUAL(err_count, 4);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
 BOOST_AUTO_TEST_SUITE(misc_failures)
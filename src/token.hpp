@@ -1,17 +1,36 @@
 #pragma once
 #include <algorithm>
-#include <execution>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <set>
+#include <string>
 #include <string_view>
-#include <unordered_set>
+#include <thread>
 #include <utility>
 
 #include "algo_utils.hpp"
+#include "arena.hpp"
 #include "args.hpp"
+#include "btree_set.hpp"
+#include "flat_hash_set.hpp"
+#include "hash_utils.hpp"
+#include "parallel.hpp"
 #include "regex.hpp"
+#include "sort_key.hpp"
+#include "spill.hpp"
 #include "string_utils.hpp"
 #include "termination_request.hpp"
+#include "unique_state.hpp"
 
 /*
 There's a lot going on in this file. It should have complete code coverage. View with:
@@ -27,77 +46,99 @@ extern std::optional<size_t> output_size_bound_testing; // NOLINT
 
 namespace choose {
 
+// a token is a compact record of its bytes. short tokens are stored inline in
+// the record. longer ones point to bytes owned elsewhere, typically in the
+// Arena that backs the output. either way it is cheap to copy and move.
+// the field is stored as offsets into the token's bytes
 struct Token {
-  std::vector<char> buffer; // NOLINT
-
-  // ctor for testing
-  Token(const char* in)
-      : buffer(in, in + strlen(in))
-#ifndef CHOOSE_DISABLE_FIELD
-        ,
-        field_begin(&*buffer.cbegin()),
-        field_end(&*buffer.cend())
-#endif
-  {
-  }
+  // a token is 32 bytes total
+  static constexpr uint32_t INLINE_CAPACITY = 20;
 
-  // ctor for testing
-  Token(std::vector<char>&& i)
-      : buffer(std::move(i))
-#ifndef CHOOSE_DISABLE_FIELD
-        ,
-        field_begin(&*buffer.cbegin()),
-        field_end(&*buffer.cend())
-#endif
-  {
+  uint32_t size = 0;
+  // offsets into the buffer, a special field of interest
+  uint32_t field_begin = 0;
+  uint32_t field_end = 0;
+
+ private:
+  // if size <= INLINE_CAPACITY: the bytes themselves.
+  // otherwise: a (potentially unaligned) pointer to the bytes
+  char storage[INLINE_CAPACITY];
+
+  void set_ptr(const char* ptr) { //
+    std::memcpy(this->storage, &ptr, sizeof(ptr));
   }
 
+ public:
   Token() = default;
-  Token(const Token&) = default;
-  Token(Token&&) = default;
-  Token& operator=(const Token&) & = default;
-  Token& operator=(Token&&) & = default;
-  ~Token() = default;
-
-  const char* cbegin() const {
-#ifndef CHOOSE_DISABLE_FIELD
-    return this->field_begin;
-#else
-    return &*this->buffer.cbegin();
-#endif
+
+  bool is_inline() const { return this->size <= INLINE_CAPACITY; }
+
+  // ctor for testing. if not stored inline then this refers to in, which must outlive the token
+  Token(const char* in) : Token(in, in + strlen(in)) {}
+
+  // short ranges are copied inline. otherwise, this refers to the range of bytes, which must outlive the token
+  Token(const char* begin, const char* end) : size(end - begin), field_end(end - begin) {
+    if (this->is_inline()) {
+      if (this->size != 0) {
+        std::memcpy(this->storage, begin, this->size);
+      }
+    } else {
+      this->set_ptr(begin);
+    }
   }
 
-  const char* cend() const {
-#ifndef CHOOSE_DISABLE_FIELD
-    return this->field_end;
-#else
-    return &*this->buffer.cend();
-#endif
+  const char* buffer_begin() const {
+    if (this->is_inline()) {
+      return this->storage;
+    }
+    const char* ptr; // NOLINT
+    std::memcpy(&ptr, this->storage, sizeof(ptr));
+    return ptr;
+  }
+
+  const char* buffer_end() const { return this->buffer_begin() + this->size; }
+
+  const char* cbegin() const { return this->buffer_begin() + this->field_begin; }
+  const char* cend() const { return this->buffer_begin() + this->field_end; }
+
+  // if not inline, copies the bytes into the arena and refers to them there instead
+  void store_in(Arena& arena) {
+    if (!this->is_inline()) {
+      this->set_ptr(arena.store(this->buffer_begin(), this->buffer_end()));
+    }
+  }
+
+  // if not inline, copies the bytes into bytes and refers to them there
+  // instead. for a token that's kept on its own, outside of any arena
+  void store_in(std::vector<char>& bytes) {
+    if (!this->is_inline()) {
+      bytes.assign(this->buffer_begin(), this->buffer_end());
+      this->set_ptr(bytes.data());
+    }
   }
 
-#ifndef CHOOSE_DISABLE_FIELD
   void set_field(const regex::code& code, const regex::match_data& data) {
     if (!code) {
-      this->field_begin = &*buffer.cbegin();
-      this->field_end = &*buffer.cend();
+      this->field_begin = 0;
+      this->field_end = this->size;
       return;
     }
-    int rc = regex::match(code, buffer.data(), buffer.size(), data, "token field");
+    const char* begin = this->buffer_begin();
+    int rc = regex::match(code, begin, this->size, data, "token field");
     if (rc > 0) {
-      regex::Match m = regex::get_match(buffer.data(), data, "token field");
-      this->field_begin = m.begin;
-      this->field_end = m.end;
+      regex::Match m = regex::get_match(begin, data, "token field");
+      this->field_begin = m.begin - begin;
+      this->field_end = m.end - begin;
     } else {
-      // already initialized field_begin and field_end to nulls (no match = empty string)
+      // no match = empty string
+      this->field_begin = 0;
+      this->field_end = 0;
     }
   }
-
-  // point to range in buffer, a special field of interest
-  const char* field_begin = 0;
-  const char* field_end = 0;
-#endif
 };
 
+static_assert(sizeof(Token) == 32);
+
 // writes an output delimiter between each token
 // and (might, depending on args) a batch output delimiter on finish.
 struct TokenOutputStream {
@@ -163,11 +204,11 @@ struct TokenOutputStream {
   }
 
   void write_output_no_truncate(const Token& t) { //
-    write_output_no_truncate(&*t.buffer.cbegin(), &*t.buffer.cend());
+    write_output_no_truncate(t.buffer_begin(), t.buffer_end());
   }
 
   void write_output(const Token& t) { //
-    write_output(&*t.buffer.cbegin(), &*t.buffer.cend());
+    write_output(t.buffer_begin(), t.buffer_end());
   }
 
   // call after all other writing has finished
@@ -195,8 +236,12 @@ using indirect = std::vector<Token>::size_type; // an index into output
 
 // various comparison related functions
 
-bool lexicographical_comparison(const Token& lhs, const Token& rhs) { //
-  return std::lexicographical_compare(lhs.cbegin(), lhs.cend(), rhs.cbegin(), rhs.cend());
+// bytes are compared as unsigned, same as memcmp (and the sort keys)
+bool lexicographical_comparison(const Token& lhs, const Token& rhs) {
+  size_t lhs_size = lhs.cend() - lhs.cbegin();
+  size_t rhs_size = rhs.cend() - rhs.cbegin();
+  int cmp = std::memcmp(lhs.cbegin(), rhs.cbegin(), std::min(lhs_size, rhs_size));
+  return cmp < 0 || (cmp == 0 && lhs_size < rhs_size);
 }
 
 bool numeric_comparison(const Token& lhs, const Token& rhs) { //
@@ -207,45 +252,127 @@ bool general_numeric_comparison(const Token& lhs, const Token& rhs) { //
   return general_numeric_compare(lhs.cbegin(), lhs.cend(), rhs.cbegin(), rhs.cend());
 }
 
+bool comparison(Comparison type, const Token& lhs, const Token& rhs) {
+  switch (type) {
+    default:
+      return lexicographical_comparison(lhs, rhs);
+      break;
+    case numeric:
+      return numeric_comparison(lhs, rhs);
+      break;
+    case general_numeric:
+      return general_numeric_comparison(lhs, rhs);
+      break;
+  }
+}
+
+// uniqueness for tokens which arrive in sorted order, while merging. tokens
+// equal under uniqueness sort equal, so they're in the same group of tokens
+// that sort equal. only the current group is remembered: its first token if
+// uniqueness is the same as the sort, or each distinct token for
+// lexicographical uniqueness
+template <typename SortLess>
+struct SortedUniqueness {
+  SortLess sort_less;
+  bool same_as_sort;
+  std::vector<char> prev_bytes; // the first token of the group
+  Token prev;
+  bool has_prev = false;
+  std::set<std::string, std::less<>> group;
+
+  SortedUniqueness(SortLess sort_less, bool same_as_sort) : sort_less(sort_less), same_as_sort(same_as_sort) {}
+
+  // returns true if t was already seen
+  bool duplicate(const Token& t) {
+    bool same_group = this->has_prev && !this->sort_less(this->prev, t) && !this->sort_less(t, this->prev);
+    if (this->same_as_sort) {
+      if (same_group) {
+        return true;
+      }
+    } else {
+      if (!same_group) {
+        this->group.clear();
+      }
+      if (!this->group.emplace(t.cbegin(), t.cend()).second) {
+        return true;
+      }
+    }
+    if (!same_group) {
+      this->prev = t;
+      this->prev.store_in(this->prev_bytes);
+      this->has_prev = true;
+    }
+    return false;
+  }
+};
+
 } // namespace
 
 struct CreateTokensResult {
   std::vector<Token> tokens;
   // used for --tui-select
   std::optional<Token> initial_selected_token = {};
+  // owns the bytes that the tokens refer to
+  Arena arena = {};
 };
 
+// receives each token instead of it being stored or written. returns true if
+// it should be the last token
+using TokenSink = std::function<bool(const Token&)>;
+
+[[noreturn]] void merge_sorted_inputs(choose::Arguments& args);
+
 // reads from args.input
 // if args.tui:
 //      returns the tokens
 // else
 //      writes to args.output, then throws a termination_request exception,
 //      which the caller should handle (exit unless unit test)
-CreateTokensResult create_tokens(choose::Arguments& args) {
+// if a token sink is given, then input is read instead, and the tokens (after
+// the ops and with the field set) are only given to the sink
+CreateTokensResult create_tokens(choose::Arguments& args, FILE* input = NULL, const TokenSink* token_sink = NULL) {
+  if (!token_sink && !args.merge_files.empty()) {
+    merge_sorted_inputs(args);
+  }
+  if (!token_sink) {
+    input = args.input;
+  }
+
   const bool single_byte_delimiter = args.in_byte_delimiter.has_value();
   const bool is_utf = args.primary ? regex::options(args.primary) & PCRE2_UTF : false;
   const bool is_invalid_utf = args.primary ? regex::options(args.primary) & PCRE2_MATCH_INVALID_UTF : false;
   regex::match_data primary_data = args.primary ? regex::create_match_data(args.primary) : NULL;
-#ifndef CHOOSE_DISABLE_FIELD
   regex::match_data field_data = args.field ? regex::create_match_data(args.field) : NULL;
-#endif
 
   // single_byte_delimiter implies not match. stating below so the compiler can hopefully leverage it
   const bool is_match = !single_byte_delimiter && args.match;
-  const bool is_direct_output = args.is_direct_output();
+  const bool is_direct_output = !token_sink && args.is_direct_output();
   // sed implies is_direct_output and is_match
   const bool is_sed = is_direct_output && is_match && args.sed;
-  const bool tokens_not_stored = args.tokens_not_stored();
+  const bool tokens_not_stored = !token_sink && args.tokens_not_stored();
   const bool has_ops = !args.ordered_ops.empty();
   const bool flush = args.flush;
   const bool tail = args.tail;
 
-  const bool unique = args.unique;
+  // with --assume-sorted, uniqueness only looks at the previous token. this
+  // is separate from the rest of the uniqueness logic
+  const bool adjacent_unique = !token_sink && args.unique && args.assume_sorted;
+  // with --unique-window or --unique-ttl, the uniqueness set forgets tokens.
+  // they are copied into it, so nothing is stored in the output
+  const bool windowed_unique = !token_sink && args.unique && args.unique_is_windowed();
+  // with --unique-hashed, only fingerprints are kept. also nothing stored in the output
+  const bool hashed_unique = !token_sink && args.unique && args.unique_hashed;
+  // with --top-frequent, only a summary of the most frequent tokens is kept.
+  // the output is made from it at the end
+  const bool top_frequent = !token_sink && args.top_frequent != 0;
+  const bool unique = !token_sink && args.unique && !args.assume_sorted && !windowed_unique && !hashed_unique && !top_frequent;
+  // with --count, the number of occurrences of each token in the output
+  const bool count = unique && args.count;
   const Comparison unique_type = args.unique_type;
-  const bool sort = args.sort;
+  const bool sort = !token_sink && args.sort;
   const Comparison sort_type = args.sort_type;
   const bool sort_reversed = args.sort_reverse;
-  const bool mem_is_bounded = args.mem_is_bounded();
+  const bool mem_is_bounded = !token_sink && args.mem_is_bounded();
 
   char subject[args.buf_size]; // match buffer
   size_t subject_size = 0;     // how full is the buffer
@@ -256,25 +383,52 @@ CreateTokensResult create_tokens(choose::Arguments& args) {
   TokenOutputStream direct_output(args); //  if is_direct_output, this is used
 
   // fields for CreateTokensResult
-  std::optional<Token> initial_selected_token = {}; // !tokens_not_stored, these two are used
+  std::optional<Token> initial_selected_token = {}; // !tokens_not_stored, these three are used
   std::vector<Token> output;
+  Arena arena;
 
-  if (args.out_end == 0) {
+  if (!token_sink && args.out_end == 0) {
     // edge case on logic. it adds a token, then checks if the out limit has been hit
     goto skip_all;
   }
 
   {
+    // uniqueness is checked before a token's bytes are stored, while they are
+    // still in the match buffer or scratch buffer. the hash set is given the
+    // candidate directly. the tree set looks up this special index, which refers
+    // to the candidate token instead of an element in the output
+    static constexpr indirect CANDIDATE = std::numeric_limits<indirect>::max();
+    const Token* candidate = nullptr;
+
+    auto deref = [&](indirect i) -> const Token& { //
+      return i == CANDIDATE ? *candidate : output[i];
+    };
+
+    // general numeric parsing is comparatively slow. for the tree set, each
+    // token's parsed key is cached, indexed the same as the output. the hash set
+    // doesn't need this since the key is recoverable from its stored hash
+    const bool cache_unique_keys = unique && args.unique_use_set && unique_type == general_numeric && !mem_is_bounded;
+    std::vector<uint64_t> unique_keys;
+    std::vector<size_t> unique_counts; // for --count. indexed the same as the output
+    uint64_t candidate_key = 0;
+
+    auto deref_key = [&](indirect i) -> uint64_t { //
+      return i == CANDIDATE ? candidate_key : unique_keys[i];
+    };
+
     auto uniqueness_set_comparison = [&](indirect lhs, indirect rhs) -> bool {
       switch (unique_type) {
         default:
-          return lexicographical_comparison(output[lhs], output[rhs]);
+          return lexicographical_comparison(deref(lhs), deref(rhs));
           break;
         case numeric:
-          return numeric_comparison(output[lhs], output[rhs]);
+          return numeric_comparison(deref(lhs), deref(rhs));
           break;
         case general_numeric:
-          return general_numeric_comparison(output[lhs], output[rhs]);
+          if (cache_unique_keys) {
+            return deref_key(lhs) < deref_key(rhs);
+          }
+          return general_numeric_comparison(deref(lhs), deref(rhs));
           break;
       }
     };
@@ -298,18 +452,43 @@ CreateTokensResult create_tokens(choose::Arguments& args) {
       }
     };
 
-    auto unordered_set_hash = [&](indirect val) -> size_t {
-      const Token& t = output[val];
+    const uint64_t hash_seed = hash::random_seed();
+
+    parallel::Threads threads{args.threads, args.pin_threads};
+
+    // when sorting everything, the output is sorted in runs by background
+    // threads while the input is still being read. the runs are merged at the
+    // end. uniqueness refers to the output by index, so the tokens can't be
+    // moved out to be sorted
+    const bool spilling = !token_sink && args.can_spill(); // see below
+    const bool overlapped_sort = sort && !args.out_start && !args.out_end && !unique && !spilling && threads.count > 1;
+    static constexpr size_t SORT_RUN_SIZE = 1 << 17;
+    std::deque<std::vector<Token>> sort_runs; // references stay valid as runs are added
+    std::optional<parallel::Background> background;
+    if (overlapped_sort) {
+      background.emplace(threads);
+    }
+
+    auto start_sort_run = [&]() {
+      std::vector<Token>& sort_run = sort_runs.emplace_back(std::move(output));
+      output = std::vector<Token>();
+      output.reserve(SORT_RUN_SIZE);
+      background->submit([&sort_run, sort_type, sort_reversed] { //
+        sort_key::sort(parallel::Threads{}, sort_run, sort_type, sort_reversed);
+      });
+    };
+
+    auto unique_hash = [&](const Token& t) -> uint64_t {
       switch (unique_type) {
-        default: {
-          auto view = std::string_view(t.cbegin(), t.cend() - t.cbegin());
-          return std::hash<std::string_view>{}(view);
-        } break;
+        default:
+          return hash::bytes(t.cbegin(), t.cend() - t.cbegin(), hash_seed);
+          break;
         case numeric:
-          return numeric_hash(t.cbegin(), t.cend());
+          return hash::mix64(numeric_hash(t.cbegin(), t.cend()) ^ hash_seed);
           break;
         case general_numeric:
-          return general_numeric_hash(t.cbegin(), t.cend());
+          // bijective from the key, so equal hashes means equal values
+          return hash::mix64(general_numeric_key(t.cbegin(), t.cend()) ^ hash_seed);
           break;
       }
     };
@@ -328,20 +507,31 @@ CreateTokensResult create_tokens(choose::Arguments& args) {
       }
     };
 
-    auto unordered_set_equals = [&](indirect lhs_arg, indirect rhs_arg) -> bool { //
-      return equality_predicate(output[lhs_arg], output[rhs_arg]);
-    };
-
-    using unordered_uniqueness_set_T = std::unordered_set<indirect, decltype(unordered_set_hash), decltype(unordered_set_equals)>;
-    using uniqueness_set_T = std::set<indirect, decltype(uniqueness_set_comparison)>;
+    using unordered_uniqueness_set_T = FlatHashSet<indirect>;
+    using uniqueness_set_T = BTreeSet<indirect, decltype(uniqueness_set_comparison)>;
     using unique_checker_T = std::variant<std::monostate, unordered_uniqueness_set_T, uniqueness_set_T>;
 
+    // with more than one thread, uniqueness is applied to batches of tokens
+    // instead of one at a time. a batch's hashes are computed in parallel. the
+    // hash set is split into shards by hash, and each shard is checked by one
+    // thread. within a shard the batch is checked in input order, so the first
+    // occurrence still wins. the batch is held in its own arena, and only the
+    // unique tokens are stored. with direct output, they're written once the
+    // batch is applied, so it doesn't apply to --flush or --sed. the batch is
+    // also applied early if the input would block
+    const bool sharded_unique = unique && !args.unique_use_set && !mem_is_bounded && !spilling && !args.tui && !flush && !args.sed && threads.count > 1;
+    static constexpr size_t UNIQUE_SHARD_BITS = 6;
+    static constexpr size_t UNIQUE_SHARDS = 1 << UNIQUE_SHARD_BITS;
+    static constexpr size_t UNIQUE_BATCH_SIZE = 1 << 14;
+    // refers to the batch instead of the output, until the batch is applied
+    static constexpr indirect UNIQUE_BATCH_BIT = indirect(1) << (std::numeric_limits<indirect>::digits - 1);
+
     unique_checker_T unique_checker = [&]() -> unique_checker_T {
-      if (unique) {
+      if (unique && !sharded_unique) {
         if (args.unique_use_set) {
           return unique_checker_T(uniqueness_set_T(uniqueness_set_comparison));
         } else {
-          auto s = unordered_uniqueness_set_T(8, unordered_set_hash, unordered_set_equals);
+          unordered_uniqueness_set_T s;
           s.max_load_factor(args.unique_load_factor);
           return unique_checker_T(std::move(s));
         }
@@ -350,19 +540,553 @@ CreateTokensResult create_tokens(choose::Arguments& args) {
       }
     }();
 
-    // returns true if output[elem] is unique. requires unique == true
-    auto uniqueness_check = [&](indirect elem) -> bool { //
+    // where the candidate should be inserted
+    uint64_t uniqueness_hash = 0;
+    size_t uniqueness_slot = 0;
+    typename uniqueness_set_T::Position uniqueness_set_position;
+
+    // returns true if t is unique. requires unique == true.
+    // if unique, then t must be appended to the output then uniqueness_insert called
+    auto uniqueness_check = [&](const Token& t) -> bool {
+      candidate = &t;
       if (unordered_uniqueness_set_T* set = std::get_if<unordered_uniqueness_set_T>(&unique_checker)) {
-        return set->insert(elem).second;
+        uniqueness_hash = unique_hash(t);
+        std::pair<size_t, bool> result;
+        if (unique_type == general_numeric) {
+          // the stored hash already matched, so it's equal without parsing again
+          result = set->find_or_prepare_insert(uniqueness_hash, [](indirect) { return true; });
+        } else {
+          auto eq = [&](indirect i) -> bool { return equality_predicate(output[i], t); };
+          result = set->find_or_prepare_insert(uniqueness_hash, eq);
+        }
+        uniqueness_slot = result.first;
+        if (count && result.second) {
+          ++unique_counts[set->slot(result.first).value];
+        }
+        return !result.second;
       } else {
-        return std::get<uniqueness_set_T>(unique_checker).insert(elem).second;
+        uniqueness_set_T& tree_set = std::get<uniqueness_set_T>(unique_checker);
+        if (cache_unique_keys) {
+          candidate_key = general_numeric_key(t.cbegin(), t.cend());
+        }
+        auto [position, found] = tree_set.find_or_prepare_insert(CANDIDATE);
+        uniqueness_set_position = position;
+        if (count && found) {
+          ++unique_counts[tree_set.at(position)];
+        }
+        return !found;
       }
     };
 
+    auto uniqueness_insert = [&](indirect elem) {
+      if (count) {
+        unique_counts.push_back(1); // elem is the last in the output
+      }
+      if (unordered_uniqueness_set_T* set = std::get_if<unordered_uniqueness_set_T>(&unique_checker)) {
+        set->insert_at(uniqueness_slot, uniqueness_hash, elem);
+      } else {
+        if (cache_unique_keys) {
+          unique_keys.push_back(candidate_key);
+        }
+        std::get<uniqueness_set_T>(unique_checker).insert_at(uniqueness_set_position, elem);
+      }
+    };
+
+    // removes an element of the output from the uniqueness set. if a candidate
+    // was checked but not inserted yet, it can still be inserted afterwards
+    auto uniqueness_erase = [&](indirect elem) {
+      if (unordered_uniqueness_set_T* set = std::get_if<unordered_uniqueness_set_T>(&unique_checker)) {
+        size_t slot = set->find(unique_hash(output[elem]), [elem](indirect i) { return i == elem; });
+        set->erase_at(slot);
+      } else {
+        uniqueness_set_T& tree_set = std::get<uniqueness_set_T>(unique_checker);
+        tree_set.erase(elem);
+        uniqueness_set_position = tree_set.find_or_prepare_insert(CANDIDATE).first; // nodes may have moved
+      }
+    };
+
+    std::vector<unordered_uniqueness_set_T> unique_shards;
+    std::vector<Token> unique_batch;
+    Arena unique_batch_arena;
+    std::optional<parallel::Background> unique_workers; // kept, since each batch is small
+    if (sharded_unique) {
+      unique_workers.emplace(threads);
+      unique_shards.resize(UNIQUE_SHARDS);
+      for (unordered_uniqueness_set_T& shard : unique_shards) {
+        shard.max_load_factor(args.unique_load_factor);
+      }
+    }
+
+    auto apply_unique_batch = [&]() {
+      const size_t n = unique_batch.size();
+      std::vector<uint64_t> hashes(n);
+      static constexpr size_t HASH_CHUNK = 1 << 12;
+      unique_workers->run((n + HASH_CHUNK - 1) / HASH_CHUNK, [&](size_t c) {
+        for (size_t i = c * HASH_CHUNK; i < std::min(n, (c + 1) * HASH_CHUNK); ++i) {
+          hashes[i] = unique_hash(unique_batch[i]);
+        }
+      });
+
+      // group by shard, keeping input order within each
+      auto shard_of = [](uint64_t hash) -> size_t { return hash >> (64 - UNIQUE_SHARD_BITS); };
+      std::vector<size_t> shard_begin(UNIQUE_SHARDS + 1, 0);
+      for (uint64_t hash : hashes) {
+        ++shard_begin[shard_of(hash) + 1];
+      }
+      for (size_t s = 0; s < UNIQUE_SHARDS; ++s) {
+        shard_begin[s + 1] += shard_begin[s];
+      }
+      std::vector<size_t> by_shard(n);
+      {
+        std::vector<size_t> next(shard_begin.begin(), shard_begin.end() - 1);
+        for (size_t i = 0; i < n; ++i) {
+          by_shard[next[shard_of(hashes[i])]++] = i;
+        }
+      }
+
+      auto deref_batch = [&](indirect v) -> const Token& { //
+        return v & UNIQUE_BATCH_BIT ? unique_batch[v & ~UNIQUE_BATCH_BIT] : output[v];
+      };
+      std::vector<char> keep(n, 0);
+      std::vector<size_t> batch_counts(count ? n : 0, 1);
+      unique_workers->run(UNIQUE_SHARDS, [&](size_t s) {
+        unordered_uniqueness_set_T& shard = unique_shards[s];
+        for (size_t k = shard_begin[s]; k < shard_begin[s + 1]; ++k) {
+          size_t i = by_shard[k];
+          const Token& t = unique_batch[i];
+          // for general numeric, the stored hash already matched, so it's equal
+          auto eq = [&](indirect v) -> bool { return unique_type == general_numeric || equality_predicate(deref_batch(v), t); };
+          auto [slot, found] = shard.find_or_prepare_insert(hashes[i], eq);
+          if (!found) {
+            shard.insert_at(slot, hashes[i], i | UNIQUE_BATCH_BIT);
+            keep[i] = 1;
+          } else if (count) {
+            // each element is in one shard, so no other thread has the same one
+            indirect v = shard.slot(slot).value;
+            ++(v & UNIQUE_BATCH_BIT ? batch_counts[v & ~UNIQUE_BATCH_BIT] : unique_counts[v]);
+          }
+        }
+      });
+
+      // the unique tokens are appended to the output, then the shards are
+      // pointed at where they ended up
+      std::vector<indirect> position(n);
+      for (size_t i = 0; i < n; ++i) {
+        if (keep[i]) {
+          Token t = unique_batch[i];
+          t.store_in(arena);
+          position[i] = output.size();
+          output.push_back(t);
+          if (count) {
+            unique_counts.push_back(batch_counts[i]);
+          }
+          if (is_direct_output) {
+            direct_output.write_output(t);
+          }
+        }
+      }
+      unique_workers->run(UNIQUE_SHARDS, [&](size_t s) {
+        unordered_uniqueness_set_T& shard = unique_shards[s];
+        for (size_t k = shard_begin[s]; k < shard_begin[s + 1]; ++k) {
+          size_t i = by_shard[k];
+          if (keep[i]) {
+            size_t slot = shard.find(hashes[i], [i](indirect v) { return v == (i | UNIQUE_BATCH_BIT); });
+            shard.slot(slot).value = position[i];
+          }
+        }
+      });
+
+      unique_batch.clear();
+      unique_batch_arena.clear();
+#ifdef OUTPUT_SIZE_BOUND_TESTING
+      if (output_size_bound_testing && output.size() > *output_size_bound_testing) {
+        throw std::runtime_error("max output size exceeded!\n");
+      }
+#endif
+    };
+
+    // for --top-frequent. the space saving algorithm: up to the capacity of
+    // tokens are tracked, each with a count. a token that isn't tracked
+    // replaces the one with the lowest count, and takes over its count plus
+    // one. the counts can only be too high, by at most the lowest count. the
+    // capacity is many times the number written, so the lowest count stays
+    // far below the ones written. each tracked token has its own copy of its
+    // bytes (unless inline), like --unique-window
+    struct FrequentEntry {
+      std::vector<char> bytes;
+      Token token;
+      uint64_t hash;
+      size_t count;
+      uint64_t arrival; // when it started being tracked
+      size_t heap_pos;
+    };
+    std::vector<FrequentEntry> frequent_entries;
+    FlatHashSet<size_t> frequent_set; // indexes frequent_entries
+    // a min heap of frequent_entries indices. the front is replaced next. of
+    // equal counts, the one tracked most recently is replaced first
+    std::vector<size_t> frequent_heap;
+    uint64_t frequent_arrival = 0;
+
+    auto frequent_before = [&](size_t lhs, size_t rhs) -> bool {
+      const FrequentEntry& l = frequent_entries[lhs];
+      const FrequentEntry& r = frequent_entries[rhs];
+      return l.count != r.count ? l.count < r.count : l.arrival > r.arrival;
+    };
+
+    auto frequent_heap_set = [&](size_t pos, size_t i) {
+      frequent_heap[pos] = i;
+      frequent_entries[i].heap_pos = pos;
+    };
+
+    // the entry at pos had its count increased (or was replaced)
+    auto frequent_sift_down = [&](size_t pos) {
+      size_t i = frequent_heap[pos];
+      while (true) {
+        size_t child = 2 * pos + 1;
+        if (child >= frequent_heap.size()) {
+          break;
+        }
+        if (child + 1 < frequent_heap.size() && frequent_before(frequent_heap[child + 1], frequent_heap[child])) {
+          ++child;
+        }
+        if (!frequent_before(frequent_heap[child], i)) {
+          break;
+        }
+        frequent_heap_set(pos, frequent_heap[child]);
+        pos = child;
+      }
+      frequent_heap_set(pos, i);
+    };
+
+    auto frequent_sift_up = [&](size_t pos) {
+      size_t i = frequent_heap[pos];
+      while (pos > 0 && frequent_before(i, frequent_heap[(pos - 1) / 2])) {
+        frequent_heap_set(pos, frequent_heap[(pos - 1) / 2]);
+        pos = (pos - 1) / 2;
+      }
+      frequent_heap_set(pos, i);
+    };
+
+    auto frequent_observe = [&](const Token& t) {
+      uint64_t hash = unique_hash(t);
+      auto eq = [&](size_t i) -> bool { return unique_type == general_numeric || equality_predicate(frequent_entries[i].token, t); };
+      auto [slot, found] = frequent_set.find_or_prepare_insert(hash, eq);
+      if (found) {
+        size_t i = frequent_set.slot(slot).value;
+        ++frequent_entries[i].count;
+        frequent_sift_down(frequent_entries[i].heap_pos);
+        return;
+      }
+
+      size_t i; // NOLINT
+      size_t new_count = 1;
+      if (frequent_entries.size() < args.top_frequent_capacity) {
+        i = frequent_entries.size();
+        frequent_entries.emplace_back();
+        frequent_heap.push_back(i);
+        frequent_entries[i].heap_pos = frequent_heap.size() - 1;
+      } else {
+        i = frequent_heap.front();
+        new_count += frequent_entries[i].count;
+        frequent_set.erase_at(frequent_set.find(frequent_entries[i].hash, [i](size_t j) { return i == j; }));
+        slot = frequent_set.find_or_prepare_insert(hash, eq).first; // the slot may have changed
+      }
+      FrequentEntry& e = frequent_entries[i];
+      e.token = t;
+      e.token.store_in(e.bytes);
+      e.hash = hash;
+      e.count = new_count;
+      e.arrival = frequent_arrival++;
+      frequent_set.insert_at(slot, hash, i);
+      // a new entry is at the back, and a replaced one at the front
+      if (e.heap_pos == 0) {
+        frequent_sift_down(0);
+      } else {
+        frequent_sift_up(e.heap_pos);
+      }
+    };
+
+    // a copy of the previous unique token, for --assume-sorted
+    std::vector<char> prev_unique_bytes;
+    Token prev_unique;
+    bool has_prev_unique = false;
+    int unique_direction = 0; // the order seen so far: 1 is ascending, -1 descending
+
+    // returns true if t isn't equal to the previous token
+    auto adjacent_uniqueness_check = [&](const Token& t) -> bool {
+      if (has_prev_unique) {
+        bool ascending = comparison(unique_type, prev_unique, t);
+        bool descending = !ascending && comparison(unique_type, t, prev_unique);
+        if (!ascending && !descending) {
+          return false;
+        }
+        int direction = ascending ? 1 : -1;
+        if (unique_direction == 0) {
+          unique_direction = direction;
+        } else if (direction != unique_direction) {
+          args.unsorted_warning();
+        }
+      }
+      prev_unique = t;
+      prev_unique.store_in(prev_unique_bytes);
+      has_prev_unique = true;
+      return true;
+    };
+
+    // for --unique-window and --unique-ttl. each remembered token has its own
+    // copy of its bytes (unless inline), which is reused once it's forgotten. they are linked
+    // from least to most recently seen
+    struct WindowEntry {
+      std::vector<char> bytes;
+      Token token;
+      uint64_t hash;
+      std::chrono::steady_clock::time_point seen;
+      size_t prev;
+      size_t next;
+    };
+    static constexpr size_t WINDOW_NONE = std::numeric_limits<size_t>::max();
+    std::vector<WindowEntry> window_entries;
+    std::vector<size_t> window_free;
+    FlatHashSet<size_t> window_set; // indexes window_entries
+    size_t window_oldest = WINDOW_NONE;
+    size_t window_newest = WINDOW_NONE;
+    const auto window_ttl = std::chrono::milliseconds(args.unique_ttl_ms);
+
+    auto window_unlink = [&](size_t i) {
+      WindowEntry& e = window_entries[i];
+      (e.prev == WINDOW_NONE ? window_oldest : window_entries[e.prev].next) = e.next;
+      (e.next == WINDOW_NONE ? window_newest : window_entries[e.next].prev) = e.prev;
+    };
+
+    auto window_link_newest = [&](size_t i) {
+      WindowEntry& e = window_entries[i];
+      e.prev = window_newest;
+      e.next = WINDOW_NONE;
+      (window_newest == WINDOW_NONE ? window_oldest : window_entries[window_newest].next) = i;
+      window_newest = i;
+    };
+
+    auto window_forget_oldest = [&]() {
+      size_t i = window_oldest;
+      window_set.erase_at(window_set.find(window_entries[i].hash, [i](size_t j) { return i == j; }));
+      window_unlink(i);
+      window_free.push_back(i);
+    };
+
+    // returns true if t hasn't been seen recently. either way, t is now the most
+    // recently seen
+    auto windowed_uniqueness_check = [&](const Token& t) -> bool {
+      auto now = std::chrono::steady_clock::time_point();
+      if (args.unique_ttl_ms) {
+        now = std::chrono::steady_clock::now();
+        while (window_oldest != WINDOW_NONE && now - window_entries[window_oldest].seen > window_ttl) {
+          window_forget_oldest();
+        }
+      }
+      uint64_t hash = unique_hash(t);
+      auto eq = [&](size_t i) -> bool { return unique_type == general_numeric || equality_predicate(window_entries[i].token, t); };
+      auto [slot, found] = window_set.find_or_prepare_insert(hash, eq);
+      if (found) {
+        size_t i = window_set.slot(slot).value;
+        window_entries[i].seen = now;
+        window_unlink(i);
+        window_link_newest(i);
+        return false;
+      }
+      if (args.unique_window && window_set.size() == args.unique_window) {
+        window_forget_oldest();
+        slot = window_set.find_or_prepare_insert(hash, eq).first; // the slot may have changed
+      }
+      size_t i; // NOLINT
+      if (window_free.empty()) {
+        i = window_entries.size();
+        window_entries.emplace_back();
+      } else {
+        i = window_free.back();
+        window_free.pop_back();
+      }
+      WindowEntry& e = window_entries[i];
+      e.token = t;
+      e.token.store_in(e.bytes);
+      e.hash = hash;
+      e.seen = now;
+      window_set.insert_at(slot, hash, i);
+      window_link_newest(i);
+      return true;
+    };
+
+    // for --unique-hashed. a token's 128 bit fingerprint is its uniqueness hash
+    // (which picks the slot) and a second hash with a different seed (which is
+    // the stored value). general numeric's hash is already exact, so the
+    // second half isn't needed there. for n distinct tokens, the chance of any
+    // collision is about n^2 / 2^129. with --unique-state they're in a file
+    // instead, which also keeps the seed
+    FlatHashSet<uint64_t> fingerprints;
+    UniqueState* unique_state = args.unique_state_table.get();
+    if (hashed_unique && !unique_state) {
+      fingerprints.max_load_factor(args.unique_load_factor);
+    }
+    const uint64_t fingerprint_seed = unique_state ? unique_state->seed() : hash_seed;
+    static constexpr size_t UNIQUE_STATE_COMMIT_SIZE = 1 << 12;
+
+    // the fingerprints are only recorded once their tokens are flushed to the output
+    auto commit_unique_state = [&]() {
+      if (fflush(args.output) != 0) {
+        throw std::runtime_error("output err");
+      }
+      unique_state->commit();
+    };
+
+    // returns true if t's fingerprint hasn't been seen
+    auto hashed_uniqueness_check = [&](const Token& t) -> bool {
+      uint64_t hash; // NOLINT
+      uint64_t check = 0;
+      if (unique_type == general_numeric) {
+        hash = hash::mix64(general_numeric_key(t.cbegin(), t.cend()) ^ fingerprint_seed);
+      } else {
+        hash = hash::bytes(t.cbegin(), t.cend() - t.cbegin(), fingerprint_seed);
+        check = hash::bytes(t.cbegin(), t.cend() - t.cbegin(), hash::mix64(fingerprint_seed + 1));
+      }
+      if (unique_state) {
+        if (unique_state->pending_size() >= UNIQUE_STATE_COMMIT_SIZE) {
+          commit_unique_state(); // each pending token has been written
+        }
+        return unique_state->insert(hash, check);
+      }
+      auto [slot, found] = fingerprints.find_or_prepare_insert(hash, [check](uint64_t v) { return v == check; });
+      if (!found) {
+        fingerprints.insert_at(slot, hash, check);
+      }
+      return !found;
+    };
+
+    // with --max-memory, once the stored tokens exceed the budget they are
+    // sorted and written to a temporary file as a run. the runs are merged at the end
+    std::deque<spill::Run<Token>> spill_runs; // references stay valid as runs are added
+
+    // a rough count of the bytes used to store the tokens
+    auto stored_bytes = [&]() -> size_t {
+      size_t ret = arena.bytes_reserved + output.size() * sizeof(Token) + unique_keys.size() * sizeof(uint64_t);
+      if (unordered_uniqueness_set_T* set = std::get_if<unordered_uniqueness_set_T>(&unique_checker)) {
+        ret += set->capacity() * (sizeof(unordered_uniqueness_set_T::Slot) + 1);
+      } else if (uniqueness_set_T* tree_set = std::get_if<uniqueness_set_T>(&unique_checker)) {
+        ret += tree_set->size() * sizeof(indirect) * 3 / 2; // nodes are at least half full
+      }
+      return ret;
+    };
+
+    // merges the runs. each run is already unique, but there can be duplicates
+    // across runs. those are next to each other in the sorted order (since
+    // uniqueness is the same as the sort, or lexicographical). the first one
+    // is from the earliest run, so it's the first occurrence. calls sink(const
+    // Token&), which returns false to stop early
+    auto merge_spill_runs = [&](auto sink) {
+      std::vector<spill::Run<Token>*> runs;
+      for (spill::Run<Token>& run : spill_runs) {
+        runs.push_back(&run);
+      }
+      SortedUniqueness<decltype(sort_comparison)> uniqueness(sort_comparison, unique_type == sort_type);
+      spill::merge(runs, sort_comparison, [&](const Token& t) -> bool {
+        if (unique && uniqueness.duplicate(t)) {
+          return true;
+        }
+        return sink(t);
+      });
+    };
+
+    // if the tree set orders the same way as the sort, then walking it in order
+    // gives the sorted output. the elements are distinct, so it's the same as a
+    // stable sort. returns false if it doesn't apply
+    auto sort_from_tree_set = [&]() -> bool {
+      uniqueness_set_T* tree_set = std::get_if<uniqueness_set_T>(&unique_checker);
+      if (!tree_set || !sort || unique_type != sort_type || mem_is_bounded) {
+        return false;
+      }
+      std::vector<Token> sorted;
+      sorted.reserve(output.size());
+      tree_set->for_each([&](indirect i) { sorted.push_back(output[i]); });
+      if (sort_reversed) {
+        std::reverse(sorted.begin(), sorted.end());
+      }
+      output = std::move(sorted);
+      return true;
+    };
+
+    auto spill_output = [&]() {
+      if (!sort_from_tree_set()) {
+        sort_key::sort(threads, output, sort_type, sort_reversed);
+      }
+      spill::Run<Token>& run = spill_runs.emplace_back();
+      for (const Token& t : output) {
+        run.write(t);
+      }
+      run.finish_writing();
+      output.clear();
+      arena.clear();
+      unique_keys.clear();
+      if (unordered_uniqueness_set_T* set = std::get_if<unordered_uniqueness_set_T>(&unique_checker)) {
+        set->clear();
+      } else if (uniqueness_set_T* tree_set = std::get_if<uniqueness_set_T>(&unique_checker)) {
+        tree_set->clear();
+      }
+
+      if (spill_runs.size() == spill::MAX_MERGE_RUNS) {
+        spill::Run<Token> merged;
+        merge_spill_runs([&](const Token& t) -> bool {
+          merged.write(t);
+          return true;
+        });
+        merged.finish_writing();
+        spill_runs.clear();
+        spill_runs.push_back(std::move(merged));
+      }
+    };
+
+    // in the mem bounded sorted case, the output is a max heap of the best
+    // tokens so far (the front is the one that would be dropped next). equal
+    // tokens are ordered by arrival, so the earliest ones are kept. the heap
+    // refers to positions in the output, which don't move
+    // in the mem bounded unsorted tail case, once the output is full it is used
+    // as a ring buffer. this is the position of the oldest token
+    size_t tail_ring_pos = 0;
+
+    std::vector<indirect> top_k_heap;
+    std::vector<uint64_t> arrival; // indexed the same as the output
+    uint64_t arrival_count = 0;
+    auto top_k_less = [&](indirect lhs, indirect rhs) -> bool {
+      if (sort_comparison(output[lhs], output[rhs])) {
+        return true;
+      }
+      if (sort_comparison(output[rhs], output[lhs])) {
+        return false;
+      }
+      return arrival[lhs] < arrival[rhs];
+    };
+
     // for when parts of a token are accumulated.
     // this is neccesary when there isn't enough room in the match buffer
     std::vector<char> fragment;
 
+    // in the mem bounded case, tokens are continuously discarded from the
+    // output but their bytes remain in the arena. once the arena has grown
+    // enough, the tokens still in use are copied to a new arena
+    static constexpr size_t COMPACT_MIN = 1 << 20;
+    size_t compact_threshold = COMPACT_MIN;
+    auto compact_arena = [&]() {
+      if (arena.bytes_used < compact_threshold) {
+        return;
+      }
+      Arena compacted;
+      for (Token& t : output) {
+        t.store_in(compacted);
+      }
+      if (initial_selected_token) {
+        initial_selected_token->store_in(compacted);
+      }
+      arena = std::move(compacted);
+      compact_threshold = std::max(COMPACT_MIN, 2 * arena.bytes_used);
+    };
+
     // this lambda applies the operations specified in the args to a candidate token.
     // returns true iff this should be the last token added to the output
     auto process_token = [&](const char* begin, const char* end) -> bool {
@@ -372,9 +1096,11 @@ CreateTokensResult create_tokens(choose::Arguments& args) {
       // memory existing in the match buffer. this buffer will get overwritten on the
       // next match iteration, so it can be considered temporary. some ops need to
       // store the result somewhere. they will take an input (begin to end) and place
-      // the result in t, a token (vec of chars). the next op will receive begin to end,
-      // but now begin and end will have been set to point within t.
+      // the result in scratch. the next op will receive begin to end, but now begin
+      // and end will have been set to point within scratch. lastly, if the token is
+      // stored, its bytes are copied into the arena and t refers to them there.
       bool t_is_set = false;
+      std::vector<char> scratch;
       Token t;
 
       bool token_is_selected = false; // for --tui-select
@@ -387,28 +1113,60 @@ CreateTokensResult create_tokens(choose::Arguments& args) {
           end = begin;
         } else {
           str::append_to_buffer(fragment, begin, end);
-          t.buffer = std::move(fragment);
+          scratch = std::move(fragment);
           t_is_set = true;
           fragment = std::vector<char>();
-          begin = &*t.buffer.cbegin();
-          end = &*t.buffer.cend();
+          begin = scratch.data();
+          end = scratch.data() + scratch.size();
         }
       }
 
-      // moves from t. returns true if the output's size increased
+      // t is a candidate; its bytes are only stored in the arena once it is
+      // known that t will be appended. returns true if the output's size increased
       auto check_unique_then_append = [&]() -> bool {
-#ifndef CHOOSE_DISABLE_FIELD
         t.set_field(args.field, field_data);
-#endif
+        if (adjacent_unique) {
+          if (!adjacent_uniqueness_check(t)) {
+            return false;
+          }
+          if (is_direct_output) {
+            return true; // it's written directly, so nothing is stored
+          }
+        }
+        if (windowed_unique) {
+          return windowed_uniqueness_check(t); // always direct output
+        }
+        if (hashed_unique) {
+          return hashed_uniqueness_check(t); // always direct output
+        }
+        if (top_frequent) {
+          frequent_observe(t); // the output is made at the end
+          return false;
+        }
         if (!mem_is_bounded) {
           // typical case
-          output.push_back(std::move(t));
-          if (unique) {
-            if (!uniqueness_check(output.size() - 1)) {
-              // the element is not unique. nothing was added to the uniqueness set
-              output.pop_back();
-              return false;
+          if (spilling && !output.empty() && stored_bytes() >= args.max_memory) {
+            // before the uniqueness check, since this clears the uniqueness set
+            spill_output();
+          }
+          if (sharded_unique) {
+            t.store_in(unique_batch_arena);
+            unique_batch.push_back(t);
+            if (unique_batch.size() == UNIQUE_BATCH_SIZE) {
+              apply_unique_batch();
             }
+            return false; // written (if direct output) when the batch is applied
+          }
+          if (unique && !uniqueness_check(t)) {
+            return false;
+          }
+          if (overlapped_sort && output.size() == SORT_RUN_SIZE) {
+            start_sort_run();
+          }
+          t.store_in(arena);
+          output.push_back(t);
+          if (unique) {
+            uniqueness_insert(output.size() - 1);
           }
         } else {
           // output size is bounded. from --tail or --out
@@ -416,35 +1174,62 @@ CreateTokensResult create_tokens(choose::Arguments& args) {
             // note that the sorting is reversed if tail is used. so this
             // handles tail and non tail cases. see UncompiledCodes.
 
-            // note also that mem_is_bounded means sort_comparison and equality_predicate
-            // are using the same sort / unique comparison type (otherwise the next lines are confusing).
-            // see Arguments::mem_is_bounded
-            auto insertion_pos = std::upper_bound(output.begin(), output.end(), t, sort_comparison);
-            if (!unique || (insertion_pos == output.begin() || !equality_predicate(insertion_pos[-1], t))) {
-              // uniqueness is not used, or t does not yet exist in output
-              if (likely(output.size() == *args.out_end)) {
-                while (insertion_pos < output.end()) {
-                  std::swap(*insertion_pos++, t);
-                }
+            // note also that mem_is_bounded means tokens equal under uniqueness
+            // are equal under sort_comparison. see Arguments::mem_is_bounded
+            if (likely(output.size() == *args.out_end)) {
+              indirect worst = top_k_heap.front();
+              if (!sort_comparison(t, output[worst])) {
+                // t arrived last, so it loses ties
                 return false;
-              } else {
-                output.insert(insertion_pos, std::move(t));
               }
-            } else {
-              // unique is being used and t already exists in the output
+              if (unique && !uniqueness_check(t)) {
+                return false;
+              }
+              std::pop_heap(top_k_heap.begin(), top_k_heap.end(), top_k_less);
+              if (unique) {
+                uniqueness_erase(worst);
+              }
+              t.store_in(arena);
+              output[worst] = t;
+              arrival[worst] = arrival_count++;
+              std::push_heap(top_k_heap.begin(), top_k_heap.end(), top_k_less);
+              if (unique) {
+                uniqueness_insert(worst);
+              }
+              compact_arena();
               return false;
+            } else {
+              if (unique && !uniqueness_check(t)) {
+                return false;
+              }
+              t.store_in(arena);
+              output.push_back(t);
+              arrival.push_back(arrival_count++);
+              top_k_heap.push_back(output.size() - 1);
+              std::push_heap(top_k_heap.begin(), top_k_heap.end(), top_k_less);
+              if (unique) {
+                uniqueness_insert(output.size() - 1);
+              }
             }
           } else {
             // unsorted memory bounded case.
-            // precondition unique is false (can't be applied in a mem bounded way)
+            // precondition unique implies !tail (see Arguments::mem_is_bounded)
+            if (unique && !uniqueness_check(t)) {
+              return false;
+            }
+            t.store_in(arena);
             if (tail && likely(output.size() == *args.out_end)) {
-              // same reasoning as above. fixed length buffer being moved around
-              auto it = output.rbegin();
-              while (it != output.rend()) {
-                std::swap(*it++, t);
+              // the output is a ring buffer. the oldest token is overwritten
+              output[tail_ring_pos++] = t;
+              if (tail_ring_pos == output.size()) {
+                tail_ring_pos = 0;
               }
+              compact_arena();
             } else {
-              output.push_back(std::move(t));
+              output.push_back(t);
+              if (unique) {
+                uniqueness_insert(output.size() - 1);
+              }
               // for non tail case caller looks at size of output to determine
               // if finished
             }
@@ -503,29 +1288,35 @@ CreateTokensResult create_tokens(choose::Arguments& args) {
             goto after_direct_apply;
           } else {
             if (ReplaceOp* rep_op = std::get_if<ReplaceOp>(&op)) {
-              rep_op->apply(t.buffer, subject, subject + subject_size, primary_data, args.primary);
+              rep_op->apply(scratch, subject, subject + subject_size, primary_data, args.primary);
             } else if (SubOp* sub_op = std::get_if<SubOp>(&op)) {
-              sub_op->apply(t.buffer, begin, end);
+              sub_op->apply(scratch, begin, end);
             } else {
               IndexOp& in_op = std::get<IndexOp>(op);
               if (!t_is_set) {
-                str::append_to_buffer(t.buffer, begin, end);
+                str::append_to_buffer(scratch, begin, end);
               }
-              in_op.apply(t.buffer);
+              in_op.apply(scratch);
             }
             t_is_set = true;
-            begin = &*t.buffer.cbegin();
-            end = &*t.buffer.cend();
+            begin = scratch.data();
+            end = scratch.data() + scratch.size();
           }
         }
       }
 
-      // if the tokens haven't been stored yet by the ops above,
-      // and a token t is needed
-      if (!tokens_not_stored && !t_is_set) {
-        str::append_to_buffer(t.buffer, begin, end);
-        begin = &*t.buffer.cbegin();
-        end = &*t.buffer.cend();
+      // a token t is needed. it refers to begin to end until it is stored
+      if (!tokens_not_stored) {
+        if (unlikely((size_t)(end - begin) > std::numeric_limits<uint32_t>::max())) {
+          throw std::runtime_error("token exceeds max size of 4GiB");
+        }
+        t = Token(begin, end);
+      }
+
+      if (token_sink) {
+        t.set_field(args.field, field_data);
+        ret = (*token_sink)(t);
+        goto end;
       }
 
       if (is_direct_output) {
@@ -544,6 +1335,9 @@ after_direct_apply:
           // code coverage reaches here. mistakenly shows finish_output as
           // unreached but throw is reached. weird.
           direct_output.finish_output();
+          if (unique_state) {
+            commit_unique_state();
+          }
           throw termination_request();
         }
         ret = false;
@@ -562,29 +1356,25 @@ after_direct_apply:
       }
 
 end:
-      if (unlikely(token_is_selected && !initial_selected_token.has_value())) {
-        Token selected;
-        // manual copy here (since copying is disabled on tokens otherwise)
-        selected.buffer = output.rbegin()->buffer;
-#ifndef CHOOSE_DISABLE_FIELD
-        selected.field_begin = output.rbegin()->field_begin;
-        selected.field_end = output.rbegin()->field_end;
-#endif
-        initial_selected_token = selected;
+      if (unlikely(token_is_selected && !initial_selected_token.has_value() && !output.empty())) {
+        initial_selected_token = output[(tail_ring_pos == 0 ? output.size() : tail_ring_pos) - 1]; // the newest token
       }
       return ret;
     };
 
     while (1) {
+      if (sharded_unique && is_direct_output && !unique_batch.empty() && str::would_block(fileno(input))) {
+        apply_unique_batch(); // the held back tokens aren't delayed while waiting for more input
+      }
       char* write_pos = &subject[subject_size];
       size_t bytes_to_read = std::min(args.bytes_to_read, args.buf_size - subject_size);
       size_t bytes_read; // NOLINT
       bool input_done;   // NOLINT
       if (flush) {
-        bytes_read = str::get_bytes_unbuffered(fileno(args.input), bytes_to_read, write_pos);
+        bytes_read = str::get_bytes_unbuffered(fileno(input), bytes_to_read, write_pos);
         input_done = bytes_read == 0;
       } else {
-        bytes_read = str::get_bytes(args.input, bytes_to_read, write_pos);
+        bytes_read = str::get_bytes(input, bytes_to_read, write_pos);
         input_done = bytes_read != bytes_to_read;
       }
       subject_size += bytes_read;
@@ -819,36 +1609,118 @@ skip_read: // do another iteration but don't read in any more bytes
       }
     }
 
+    if (token_sink) {
+      return CreateTokensResult();
+    }
+
+    if (!unique_batch.empty()) {
+      apply_unique_batch();
+    }
+    unique_shards.clear();
+
+    // for --count and --top-frequent, a token is rewritten with its count in
+    // front, like uniq -c. its field moves along with it, so sorting still
+    // looks at the same part
+    auto with_count = [&](const Token& t, size_t n) -> Token {
+      char prefix[24];
+      size_t prefix_size = snprintf(prefix, sizeof(prefix), "%7zu ", n);
+      char* bytes = arena.allocate(prefix_size + t.size);
+      std::memcpy(bytes, prefix, prefix_size);
+      if (t.size != 0) {
+        std::memcpy(bytes + prefix_size, t.buffer_begin(), t.size);
+      }
+      Token ret(bytes, bytes + prefix_size + t.size);
+      ret.field_begin = t.field_begin + prefix_size;
+      ret.field_end = t.field_end + prefix_size;
+      return ret;
+    };
+
+    if (count) {
+      for (size_t i = 0; i < output.size(); ++i) {
+        output[i] = with_count(output[i], unique_counts[i]);
+      }
+    }
+
+    if (top_frequent) {
+      // most frequent first. of equal counts, the one tracked first
+      std::vector<size_t> order = std::move(frequent_heap);
+      size_t written = std::min(order.size(), args.top_frequent);
+      std::partial_sort(order.begin(), order.begin() + written, order.end(), [&](size_t lhs, size_t rhs) { return frequent_before(rhs, lhs); });
+      for (size_t i = 0; i < written; ++i) {
+        output.push_back(with_count(frequent_entries[order[i]].token, frequent_entries[order[i]].count));
+      }
+    }
+
     if (is_direct_output) {
       direct_output.finish_output();
+      if (unique_state) {
+        commit_unique_state();
+      }
       throw termination_request();
     }
 
+    const bool output_sorted = sort_from_tree_set();
+
     if (unordered_uniqueness_set_T* uniqueness_unordered_set = std::get_if<unordered_uniqueness_set_T>(&unique_checker)) {
       uniqueness_unordered_set->clear();
     } else if (uniqueness_set_T* set = std::get_if<uniqueness_set_T>(&unique_checker)) {
       set->clear();
     }
 
-#ifdef CHOOSE_FUZZING_APPLIED
-    auto policy = std::execution::seq; // tbb false positive
-#else
-    auto policy = std::execution::par_unseq;
-#endif
+    if (!spill_runs.empty()) {
+      // the last run stays in memory
+      if (!output_sorted) {
+        sort_key::sort(threads, output, sort_type, sort_reversed);
+      }
+      spill_runs.emplace_back(output);
+      merge_spill_runs([&](const Token& t) -> bool {
+        direct_output.write_output(t);
+        return direct_output.out_count != args.out_end;
+      });
+      direct_output.finish_output();
+      throw termination_request();
+    }
 
     if (!args.out_start && !args.out_end) {
       // no truncation needed. this is the simplest case
-      if (args.sort) {
-        if (args.sort_stable) {
-          std::stable_sort(policy, output.begin(), output.end(), sort_comparison);
+      if (args.sort && !output_sorted) {
+        // always stable, so sort_stable isn't needed here
+        if (!sort_runs.empty()) {
+          // the last run is sorted here while the others finish
+          sort_key::sort(parallel::Threads{}, output, sort_type, sort_reversed);
+          sort_runs.push_back(std::move(output));
+          background->wait();
+          output = std::vector<Token>();
+          std::vector<size_t> bounds{0};
+          for (std::vector<Token>& sort_run : sort_runs) {
+            bounds.push_back(bounds.back() + sort_run.size());
+          }
+          output.reserve(bounds.back());
+          for (std::vector<Token>& sort_run : sort_runs) {
+            output.insert(output.end(), sort_run.begin(), sort_run.end());
+            sort_run = std::vector<Token>();
+          }
+          parallel::merge_runs(threads, output.data(), std::move(bounds), sort_comparison);
         } else {
-          std::sort(policy, output.begin(), output.end(), sort_comparison);
+          sort_key::sort(threads, output, sort_type, sort_reversed);
         }
       }
     } else {
       // truncate the ends
       if (mem_is_bounded) {
-        // sort and end truncation has already been applied
+        // end truncation has already been applied
+        if (sort) {
+          std::sort_heap(top_k_heap.begin(), top_k_heap.end(), top_k_less);
+          std::vector<Token> sorted;
+          sorted.reserve(output.size());
+          for (indirect i : top_k_heap) {
+            sorted.push_back(output[i]);
+          }
+          output = std::move(sorted);
+        } else if (tail) {
+          // oldest first
+          std::rotate(output.begin(), output.begin() + tail_ring_pos, output.end());
+        }
       } else {
         // truncate the end
         if (tail && !sort) {
@@ -863,12 +1735,9 @@ skip_read: // do another iteration but don't read in any more bytes
           if (middle > output.end()) {
             middle = output.end();
           }
-          if (args.sort) {
-            if (args.sort_stable) {
-              stable_partial_sort(policy, output.begin(), middle, output.end(), sort_comparison);
-            } else {
-              std::partial_sort(policy, output.begin(), middle, output.end(), sort_comparison);
-            }
+          if (args.sort && !output_sorted) {
+            // faster than std::partial_sort, so it's used even if stability isn't needed
+            stable_partial_sort(threads, output.begin(), middle, output.end(), sort_comparison);
           }
           output.resize(middle - output.begin());
         }
@@ -908,7 +1777,178 @@ skip_all:
     throw termination_request();
   }
 
-  return CreateTokensResult{std::move(output), std::move(initial_selected_token)};
+  return CreateTokensResult{std::move(output), std::move(initial_selected_token), std::move(arena)};
+}
+
+namespace {
+
+// for --merge. each input is tokenized by create_tokens on its own thread,
+// since the reading loop can't stop partway through. only one thread runs at a
+// time, like coroutines: an input's thread fills a batch of tokens then hands
+// the turn back. so the arguments (and the state in the ops) are never used
+// by two threads at once
+struct InputMerger {
+  static constexpr size_t BATCH_SIZE = 1 << 10;
+
+  struct Input {
+    std::unique_ptr<FILE, decltype(&fclose)> file{nullptr, &fclose}; // unset for stdin
+    FILE* stream = nullptr;
+    std::thread thread;
+    Arena arena; // owns the batch's bytes
+    std::vector<Token> batch;
+    size_t pos = 0;
+    bool finished = false;
+    std::exception_ptr error;
+  };
+
+  Arguments& args;
+  std::deque<Input> inputs; // references stay valid as inputs are added
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t turn; // the input whose thread may run. inputs.size() for the merging thread
+  bool stopping = false;
+
+  explicit InputMerger(Arguments& args) : args(args), turn(args.merge_files.size()) {
+    for (FILE* stream : args.merge_streams) {
+      Input& in = this->inputs.emplace_back();
+      if (stream == NULL) {
+        in.stream = args.input;
+      } else {
+        in.file.reset(stream);
+        in.stream = stream;
+      }
+    }
+    for (size_t i = 0; i < this->inputs.size(); ++i) {
+      this->inputs[i].thread = std::thread([this, i] { this->produce(i); });
+    }
+  }
+
+  InputMerger(const InputMerger&) = delete;
+  InputMerger& operator=(const InputMerger&) = delete;
+
+  ~InputMerger() {
+    this->stopping = true;
+    for (size_t i = 0; i < this->inputs.size(); ++i) {
+      if (!this->inputs[i].finished) {
+        this->run_turn(i); // lets it finish
+      }
+      this->inputs[i].thread.join();
+    }
+  }
+
+  void wait_for_turn(std::unique_lock<std::mutex>& lock, size_t i) { //
+    this->cv.wait(lock, [&] { return this->turn == i; });
+  }
+
+  void produce(size_t i) {
+    Input& in = this->inputs[i];
+    {
+      std::unique_lock<std::mutex> lock(this->mutex);
+      this->wait_for_turn(lock, i);
+    }
+    try {
+      TokenSink sink = [&](const Token& t) -> bool {
+        if (this->stopping) {
+          return true;
+        }
+        Token stored = t;
+        stored.store_in(in.arena);
+        in.batch.push_back(stored);
+        if (in.batch.size() == BATCH_SIZE) {
+          std::unique_lock<std::mutex> lock(this->mutex);
+          this->turn = this->inputs.size();
+          this->cv.notify_all();
+          this->wait_for_turn(lock, i);
+        }
+        return this->stopping;
+      };
+      if (!this->stopping) {
+        create_tokens(this->args, in.stream, &sink);
+      }
+    } catch (...) {
+      in.error = std::current_exception();
+    }
+    std::lock_guard<std::mutex> lock(this->mutex);
+    in.finished = true;
+    this->turn = this->inputs.size();
+    this->cv.notify_all();
+  }
+
+  // replaces input i's batch with its next one
+  void run_turn(size_t i) {
+    Input& in = this->inputs[i];
+    in.batch.clear();
+    in.arena.clear();
+    in.pos = 0;
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->turn = i;
+    this->cv.notify_all();
+    this->wait_for_turn(lock, this->inputs.size());
+    if (in.error && !this->stopping) {
+      std::rethrow_exception(in.error);
+    }
+  }
+
+  // moves input i to its next token. returns false if there are none left
+  bool next(size_t i) {
+    Input& in = this->inputs[i];
+    if (++in.pos < in.batch.size()) {
+      return true;
+    }
+    if (in.finished) {
+      return false;
+    }
+    this->run_turn(i);
+    return !in.batch.empty();
+  }
+
+  // gets the first token from input i. returns false if it has none
+  bool start(size_t i) {
+    this->run_turn(i);
+    return !this->inputs[i].batch.empty();
+  }
+
+  const Token& current(size_t i) const { return this->inputs[i].batch[this->inputs[i].pos]; }
+};
+
+} // namespace
+
+// like sort -m. each input is already sorted, and the tokens from all of them
+// are merged and written to the output. only a batch of tokens from each input
+// is held at once. uniqueness is applied to each group of tokens that sort
+// equal, like when spilling
+void merge_sorted_inputs(choose::Arguments& args) {
+  TokenOutputStream direct_output(args);
+  if (args.out_end != 0) {
+    InputMerger merger(args);
+    std::vector<bool> exhausted;
+    for (size_t i = 0; i < merger.inputs.size(); ++i) {
+      exhausted.push_back(!merger.start(i));
+    }
+    auto less = [&](size_t a, size_t b) -> bool {
+      if (args.sort_reverse) {
+        std::swap(a, b);
+      }
+      return comparison(args.sort_type, merger.current(a), merger.current(b));
+    };
+    LoserTree<decltype(less)> tree(merger.inputs.size(), less, std::move(exhausted));
+
+    auto sort_less = [&](const Token& lhs, const Token& rhs) -> bool { return comparison(args.sort_type, lhs, rhs); };
+    SortedUniqueness<decltype(sort_less)> uniqueness(sort_less, args.unique_type == args.sort_type);
+    while (!tree.empty()) {
+      size_t i = tree.winner();
+      const Token& t = merger.current(i);
+      if (!args.unique || !uniqueness.duplicate(t)) {
+        direct_output.write_output(t);
+        if (direct_output.out_count == args.out_end) {
+          break;
+        }
+      }
+      tree.replay(!merger.next(i));
+    }
+  }
+  direct_output.finish_output();
+  throw termination_request();
 }
 
 } // namespace choose
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "flat_hash_set.hpp"
+#include "hash_utils.hpp"
+
+namespace choose {
+
+// --unique-state. a hash table of token fingerprints, kept in a file so that
+// uniqueness carries over between runs. the file is mapped into memory; the
+// page cache decides what's resident, so it can be larger than ram. changes
+// are written in place as tokens arrive.
+//
+// each slot is a 128 bit fingerprint (see --unique-hashed). linear probing, with
+// a hash of 0 marking an empty slot. the seed is chosen when the file is created
+// and kept in it, since the fingerprints are only comparable with the same seed.
+//
+// a new fingerprint is pending until commit is called, which should be after
+// its token is flushed to the output. so a token that's lost (e.g. the process
+// is killed with it still buffered) isn't suppressed in later runs. instead,
+// tokens written since the last commit might be written again
+struct UniqueState {
+ private:
+  static constexpr char MAGIC[8] = {'c', 'h', 'o', 'o', 's', 'e', 'u', 's'};
+  static constexpr uint32_t VERSION = 2;
+  static constexpr uint64_t MIN_CAPACITY = 1 << 16;
+
+  struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t comparison; // the type of uniqueness. tokens are hashed differently for each
+    uint64_t selection;  // which part of each token is compared (e.g. --field)
+    uint64_t seed;
+    uint64_t capacity; // a power of 2
+    uint64_t size;
+  };
+
+  struct Slot {
+    uint64_t hash;
+    uint64_t check;
+  };
+
+  std::string path;
+  int fd = -1;
+  void* mapping = MAP_FAILED;
+  size_t mapping_size = 0;
+
+  std::vector<Slot> pending;
+  FlatHashSet<uint64_t> pending_set; // the check of each pending fingerprint
+
+  Header& header() const { return *static_cast<Header*>(this->mapping); }
+  Slot* slots() const { return reinterpret_cast<Slot*>(static_cast<Header*>(this->mapping) + 1); }
+
+  static size_t file_size(uint64_t capacity) { return sizeof(Header) + capacity * sizeof(Slot); }
+
+  [[noreturn]] void fail(const char* what) const { //
+    throw std::runtime_error(std::string(what) + " --unique-state file " + this->path + ": " + strerror(errno));
+  }
+
+  void map(int fd, size_t size) {
+    void* m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) {
+      this->fail("failed to map");
+    }
+    this->unmap();
+    this->mapping = m;
+    this->mapping_size = size;
+  }
+
+  void unmap() {
+    if (this->mapping != MAP_FAILED) {
+      munmap(this->mapping, this->mapping_size);
+      this->mapping = MAP_FAILED;
+    }
+  }
+
+  // an empty table in fd, which must be an empty file
+  void create(int fd, uint32_t comparison, uint64_t selection, uint64_t capacity, uint64_t seed) {
+    if (ftruncate(fd, file_size(capacity)) != 0) {
+      this->fail("failed to resize");
+    }
+    this->map(fd, file_size(capacity));
+    Header& h = this->header();
+    std::memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version = VERSION;
+    h.comparison = comparison;
+    h.selection = selection;
+    h.seed = seed;
+    h.capacity = capacity;
+    h.size = 0;
+  }
+
+  // the first slot which is empty or has this fingerprint
+  Slot& probe(uint64_t hash, uint64_t check) const {
+    uint64_t mask = this->header().capacity - 1;
+    Slot* s = this->slots();
+    for (uint64_t i = hash & mask;; i = (i + 1) & mask) {
+      if (s[i].hash == 0 || (s[i].hash == hash && s[i].check == check)) {
+        return s[i];
+      }
+    }
+  }
+
+  // rehashed into a new file twice the size, which then replaces the old one
+  void grow() {
+    std::string tmp_path = this->path + ".XXXXXX";
+    int new_fd = mkstemp(&tmp_path[0]);
+    if (new_fd == -1) {
+      this->fail("failed to grow");
+    }
+    struct stat st; // NOLINT
+    if (fstat(this->fd, &st) == 0) {
+      fchmod(new_fd, st.st_mode & 07777); // mkstemp only allows the owner
+    }
+    void* old_mapping = this->mapping;
+    size_t old_mapping_size = this->mapping_size;
+    Header old_header = this->header();
+    const Slot* old_slots = this->slots();
+    this->mapping = MAP_FAILED; // kept until the slots are copied
+
+    this->create(new_fd, old_header.comparison, old_header.selection, old_header.capacity * 2, old_header.seed);
+    for (uint64_t i = 0; i < old_header.capacity; ++i) {
+      if (old_slots[i].hash != 0) {
+        this->probe(old_slots[i].hash, old_slots[i].check) = old_slots[i];
+      }
+    }
+    this->header().size = old_header.size;
+    munmap(old_mapping, old_mapping_size);
+
+    if (flock(new_fd, LOCK_EX) != 0 || rename(tmp_path.c_str(), this->path.c_str()) != 0) {
+      unlink(tmp_path.c_str());
+      this->fail("failed to replace");
+    }
+    close(this->fd);
+    this->fd = new_fd;
+  }
+
+  // see the constructor. on failure, what was opened is left for it to clean up
+  void open_file(uint32_t comparison, uint64_t selection) {
+    const char* path = this->path.c_str();
+    struct stat st; // NOLINT
+    while (true) {
+      this->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+      if (this->fd == -1) {
+        this->fail("failed to open");
+      }
+      if (flock(this->fd, LOCK_EX) != 0) {
+        this->fail("failed to lock");
+      }
+      if (fstat(this->fd, &st) != 0) {
+        this->fail("failed to read");
+      }
+      // while waiting for the lock, another process might have grown the
+      // table, replacing the file. then this one is stale and is reopened
+      struct stat current; // NOLINT
+      if (stat(path, &current) == 0 && current.st_ino == st.st_ino && current.st_dev == st.st_dev) {
+        break;
+      }
+      close(this->fd);
+      this->fd = -1;
+    }
+    if (st.st_size == 0) {
+      this->create(this->fd, comparison, selection, MIN_CAPACITY, hash::random_seed() | 1);
+      return;
+    }
+
+    Header h; // NOLINT
+    if ((size_t)st.st_size < sizeof(Header) || pread(this->fd, &h, sizeof(h), 0) != sizeof(h)                                     //
+        || std::memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.version != VERSION                                                 //
+        || h.capacity < MIN_CAPACITY || (h.capacity & (h.capacity - 1)) != 0 || (size_t)st.st_size != file_size(h.capacity)) {
+      throw std::runtime_error("--unique-state file " + this->path + " is not valid");
+    }
+    if (h.comparison != comparison) {
+      throw std::runtime_error("--unique-state file " + this->path + " was made with a different type of uniqueness");
+    }
+    if (h.selection != selection) {
+      throw std::runtime_error("--unique-state file " + this->path + " was made with a different --field or --index");
+    }
+    this->map(this->fd, st.st_size);
+  }
+
+ public:
+  // opens the file, or creates it if it doesn't exist (or is empty). it's
+  // locked for as long as this exists
+  UniqueState(const char* path, uint32_t comparison, uint64_t selection) : path(path) {
+    try {
+      this->open_file(comparison, selection);
+    } catch (...) {
+      this->unmap();
+      if (this->fd != -1) {
+        close(this->fd);
+      }
+      throw;
+    }
+  }
+
+  UniqueState(const UniqueState&) = delete;
+  UniqueState& operator=(const UniqueState&) = delete;
+
+  ~UniqueState() {
+    this->unmap();
+    if (this->fd != -1) {
+      close(this->fd); // also unlocks
+    }
+  }
+
+  uint64_t seed() const { return this->header().seed; }
+
+  // returns true if the fingerprint wasn't in the table or pending, in which case it's added as pending
+  bool insert(uint64_t hash, uint64_t check) {
+    if (hash == 0) {
+      hash = 1; // 0 marks empty slots
+    }
+    if (this->probe(hash, check).hash != 0) {
+      return false;
+    }
+    auto [slot, found] = this->pending_set.find_or_prepare_insert(hash, [check](uint64_t v) { return v == check; });
+    if (found) {
+      return false;
+    }
+    this->pending_set.insert_at(slot, hash, check);
+    this->pending.push_back(Slot{hash, check});
+    return true;
+  }
+
+  size_t pending_size() const { return this->pending.size(); }
+
+  // adds the pending fingerprints to the table
+  void commit() {
+    for (const Slot& p : this->pending) {
+      if ((this->header().size + 1) * 4 > this->header().capacity * 3) {
+        this->grow();
+      }
+      this->probe(p.hash, p.check) = p;
+      ++this->header().size;
+    }
+    this->pending.clear();
+    this->pending_set.clear();
+  }
+};
+
+} // namespace choose